@@ -0,0 +1,82 @@
+#ifndef FA_ANNOTATION_FILE_HH
+#define FA_ANNOTATION_FILE_HH
+
+
+#include <string>
+#include <vector>
+
+#include <ert/ObjectDetection.hh>
+
+
+namespace ert {
+
+
+/**
+ * Bulk annotation file, with the parts of many images indexed by the image
+ * path. It replaces the '.pts' files next to each image:
+ *
+ *     AnnotationFile::save("dataset.ann", imageFileNames, annotations);
+ *
+ *     AnnotationFile annotations("dataset.ann");
+ *     ObjectDetection annot;
+ *     if (annotations.find("images/0001.jpg", annot)) ...
+ *
+ * The file is mapped in memory when opened and the index is sorted by path,
+ * so finding the annotations of an image is a binary search and does not
+ * touch the file system.
+ */
+class AnnotationFile
+{
+
+	public:
+		AnnotationFile(
+			const std::string &fileName );
+
+		~AnnotationFile();
+
+		/**
+		 * Returns the number of images in the file.
+		 */
+		size_t size() const;
+
+		/**
+		 * Returns the path of the given image.
+		 */
+		std::string getImageFileName(
+			size_t index ) const;
+
+		/**
+		 * Fill 'annot' with the parts of the given image and their bounding
+		 * box (like 'ObjectDetection::load'). Returns false if the image is
+		 * not in the file.
+		 */
+		bool find(
+			const std::string &imageFileName,
+			ObjectDetection &annot ) const;
+
+		/**
+		 * Create an annotation file with the parts of the given images.
+		 */
+		static void save(
+			const std::string &fileName,
+			const std::vector<std::string> &imageFileNames,
+			const std::vector<ObjectDetection> &annotations );
+
+	private:
+
+		void *data;
+
+		size_t dataSize;
+
+		size_t count;
+
+		AnnotationFile( const AnnotationFile & );
+
+		AnnotationFile &operator=( const AnnotationFile & );
+
+};
+
+
+} // namespace ert
+
+#endif // FA_ANNOTATION_FILE_HH
@@ -95,6 +95,13 @@ class ObjectDetection
 
 		void remove( size_t from, size_t to );
 
+		/**
+		 * Returns a copy with only the given parts (in the given order) and
+		 * the same rectangle.
+		 */
+		ObjectDetection subset(
+			const std::vector<unsigned long> &indices ) const;
+
 	private:
 		Rect rect;
 		std::vector<Point2f> parts;
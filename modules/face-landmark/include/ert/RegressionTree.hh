@@ -50,6 +50,10 @@ namespace ert {
 				const std::vector<double>& feature_pixel_values
 			) const;
 
+			const cv::Mat& operator()(
+				const uint8_t *feature_pixel_values
+			) const;
+
 			void serialize( std::ostream &out ) const;
 
 			void deserialize( std::istream &in );
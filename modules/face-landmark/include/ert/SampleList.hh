@@ -12,11 +12,21 @@
 namespace ert {
 
 
+class AnnotationFile;
+
+
+/**
+ * Loads the image and the annotations of a sample.
+ *
+ * The samples of a list are loaded in parallel when the loader declares
+ * itself thread-safe, i.e. 'load' may be called concurrently (for different
+ * files) from several threads.
+ */
 class SampleLoader
 {
 
 	public:
-		SampleLoader()
+		SampleLoader() : faceSize(0), annotationFile(NULL)
 		{
 			// nothing to do
 		}
@@ -31,6 +41,69 @@ class SampleLoader
 			cv::Mat &image,
 			ObjectDetection &annot ) = 0;
 
+		virtual bool isThreadSafe() const
+		{
+			return false;
+		}
+
+		/**
+		 * Set the size (in pixels) of the larger side of the face bounding
+		 * box in the loaded images. Larger images are reduced at load time
+		 * and their annotations are scaled to match. Zero (the default)
+		 * keeps the original size.
+		 */
+		void setFaceSize( int size )
+		{
+			faceSize = size;
+		}
+
+		int getFaceSize() const
+		{
+			return faceSize;
+		}
+
+		/**
+		 * Read the annotations from the given bulk annotation file instead
+		 * of the '.pts' file of each image. The file must exist while the
+		 * loader is used.
+		 */
+		void setAnnotationFile( const AnnotationFile *file )
+		{
+			annotationFile = file;
+		}
+
+		const AnnotationFile *getAnnotationFile() const
+		{
+			return annotationFile;
+		}
+
+	protected:
+		/**
+		 * Load the annotations of the given image, from the annotation file
+		 * (if any) or from the '.pts' file of the image. Missing annotations
+		 * are reported and leave 'annot' empty.
+		 */
+		void loadAnnotations(
+			const std::string &imageFileName,
+			ObjectDetection &annot ) const;
+
+		/**
+		 * Read the given image in gray, reduced according to the face size
+		 * and the face bounding box of the given annotations. Returns the
+		 * scale applied to the image.
+		 *
+		 * When possible, the image is reduced by the JPEG decoder itself,
+		 * which is much faster than decoding the full image.
+		 */
+		double readImage(
+			const std::string &imageFileName,
+			const ObjectDetection &annot,
+			cv::Mat &image ) const;
+
+	private:
+		int faceSize;
+		const AnnotationFile *annotationFile;
+
 };
 
 
@@ -47,14 +120,28 @@ class BasicSampleLoader : public SampleLoader
 			cv::Mat &image,
 			ObjectDetection &annot );
 
+		bool isThreadSafe() const;
+
 };
 
 
+/**
+ * List of samples (images and their annotations).
+ *
+ * The pixels of the images are stored in a few large arenas (or in the
+ * mapping of a cache file) and the annotations in a single vector, so the
+ * whole list is released at once by the destructor. The pointers returned by
+ * 'getImages' and 'getAnnotations' are valid while the list exists.
+ */
 // ScriptFile?
 class SampleList
 {
 
 	public:
+		/**
+		 * Load the samples listed in the given script file, or the samples
+		 * stored in the given cache file (see 'save').
+		 */
 		SampleList(
 			const std::string &fileName,
 			SampleLoader *loader = NULL );
@@ -82,8 +169,67 @@ class SampleList
 			const std::string &fileName,
 			const std::string &extension );
 
+		/**
+		 * Save the loaded samples (images as returned by the loader, rects,
+		 * parts and file names) in a cache file. Opening the cache maps the
+		 * images from the file, so it is much faster than loading the
+		 * original script again.
+		 */
+		void save(
+			const std::string &fileName ) const;
+
+		/**
+		 * Parse a line of a script file. Besides the image path, the lines
+		 * written by 'tool_index' contain the file size and the image
+		 * dimensions (separated by tabs); these fields are zero if the line
+		 * does not have them. The dimensions are only used to schedule the
+		 * parallel decoding: the loaders may reduce, scale and convert the
+		 * images, so they cannot size the image buffers.
+		 */
+		static void parseScriptLine(
+			const std::string &line,
+			std::string &imageFileName,
+			uint64_t &fileSize,
+			int &width,
+			int &height );
+
+		/**
+		 * Returns whether the given file is a cache created by 'save'.
+		 */
+		static bool isCache(
+			const std::string &fileName );
+
 	private:
 
+		static const size_t ARENA_SIZE = 64 * 1024 * 1024;
+
+		std::vector<cv::Mat> arenas;
+
+		size_t arenaUsed;
+
+		std::vector<cv::Mat> imageData;
+
+		std::vector<ObjectDetection> objects;
+
+		void *cacheData;
+
+		size_t cacheSize;
+
+		void loadCache(
+			const std::string &fileName );
+
+		cv::Mat allocateImage(
+			int rows,
+			int cols,
+			int type );
+
+		void setObjects(
+			std::vector<ObjectDetection> &loadedObjects );
+
+		SampleList( const SampleList & );
+
+		SampleList &operator=( const SampleList & );
+
 		std::vector<cv::Mat*> images;
 
 		std::vector<std::vector<ObjectDetection*> > annotations;
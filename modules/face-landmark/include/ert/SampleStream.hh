@@ -0,0 +1,112 @@
+#ifndef FA_SAMPLE_STREAM_HH
+#define FA_SAMPLE_STREAM_HH
+
+
+#include <opencv2/opencv.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+#include <ert/ObjectDetection.hh>
+#include <ert/SampleList.hh>
+
+
+namespace ert {
+
+
+/**
+ * Reads the samples of a script file one at a time, in the order of the
+ * script, with bounded memory:
+ *
+ *     SampleStream stream("test.txt", &loader, 16);
+ *     SampleStream::Sample sample;
+ *     while (stream.next(sample))
+ *         model.detect(sample.image, sample.annot.get_rect());
+ *
+ * Background threads load (i.e. decode) the next samples while the current
+ * one is used; at most 'prefetch' samples are kept in memory. Samples that
+ * fail to load are skipped, like in 'SampleList'. Loaders that are not
+ * thread-safe use a single background thread.
+ */
+class SampleStream
+{
+
+	public:
+		struct Sample
+		{
+			/// Position of the sample in the script file
+			size_t index;
+			std::string imageFileName;
+			cv::Mat image;
+			ObjectDetection annot;
+		};
+
+		SampleStream(
+			const std::string &fileName,
+			SampleLoader *loader = NULL,
+			size_t prefetch = 8,
+			int threads = 2 );
+
+		~SampleStream();
+
+		/**
+		 * Returns the number of files in the script (including the ones that
+		 * may fail to load).
+		 */
+		size_t size() const;
+
+		/**
+		 * Moves the next sample to 'sample', waiting for it to be loaded.
+		 * Returns false at the end of the script.
+		 */
+		bool next(
+			Sample &sample );
+
+	private:
+		enum SlotState
+		{
+			SLOT_EMPTY,
+			SLOT_LOADING,
+			SLOT_READY,
+			SLOT_FAILED
+		};
+
+		std::ifstream script;
+
+		SampleLoader *loader;
+
+		BasicSampleLoader defaultLoader;
+
+		size_t count;
+
+		/// index of the next sample to load and to return
+		size_t nextLoad, nextRead;
+
+		std::vector<Sample> slots;
+
+		std::vector<SlotState> states;
+
+		bool stopping;
+
+		pthread_mutex_t mutex;
+
+		pthread_cond_t changed;
+
+		std::vector<pthread_t> workers;
+
+		static void *run(
+			void *stream );
+
+		void work();
+
+		SampleStream( const SampleStream & );
+
+		SampleStream &operator=( const SampleStream & );
+
+};
+
+
+} // namespace ert
+
+#endif // FA_SAMPLE_STREAM_HH
@@ -58,6 +58,42 @@ class ShapePredictor : public Serializable
             return initial_shape.cols;
         }
 
+        unsigned long num_cascades (
+        ) const
+        {
+            return forests.size();
+        }
+
+        /**
+         * Number of trees in the given cascade level. This may be smaller than
+         * the configured amount if the training stopped early.
+         */
+        unsigned long num_trees (
+            unsigned long cascade
+        ) const
+        {
+            return forests[cascade].size();
+        }
+
+        const Mat &get_initial_shape (
+        ) const
+        {
+            return initial_shape;
+        }
+
+        const std::vector<std::vector<RegressionTree> > &get_forests (
+        ) const
+        {
+            return forests;
+        }
+
+        /**
+         * Returns the feature pool pixels of each cascade level, in the
+         * normalized shape space (i.e. as given to the constructor).
+         */
+        std::vector<std::vector<Point2f> > get_pixel_coordinates (
+        ) const;
+
 		void serialize( std::ostream &out ) const;
 
 		void deserialize( std::istream &in );
@@ -78,6 +114,65 @@ double test_shape_predictor (
 );
 
 
+/**
+ * Results of 'evaluate_shape_predictor'. The errors are the distances
+ * between the predicted and the annotated parts divided by the object scale.
+ */
+struct ShapePredictorEvaluation
+{
+	/// Mean error of all parts of all objects (NaN if no object has a
+	/// positive scale, in which case the errors are undefined)
+	double mean_error;
+	/// Mean error of each part (NaN like above)
+	std::vector<double> part_errors;
+	unsigned long faces;
+	int threads;
+	/// Detection time of each face (milliseconds)
+	double mean_latency;
+	double latency_p50;
+	double latency_p95;
+	double latency_p99;
+	/// Faces per second (wall time of the whole evaluation)
+	double throughput;
+
+	/**
+	 * Write the results as a JSON object (in a single line). The values
+	 * that are not finite are written as null.
+	 */
+	void write_json(
+		std::ostream &out ) const;
+};
+
+
+/**
+ * Same as 'test_shape_predictor' but the objects are evaluated in parallel,
+ * using the given amount of threads (zero uses the OpenMP default), and the
+ * results include the error of each part and the detection times.
+ */
+ShapePredictorEvaluation evaluate_shape_predictor (
+	const ShapePredictor& sp,
+	const std::vector<Mat*>& images,
+	const std::vector<std::vector<ObjectDetection*> >& objects,
+	const std::vector<std::vector<double> >& scales,
+	int threads = 0
+);
+
+
+class SampleStream;
+
+/**
+ * Same as above, but the samples are read from the given stream as they are
+ * evaluated. The error of each object is divided by the value returned by
+ * 'scale' (if not NULL); the objects whose scale is not positive are skipped.
+ * Returns NaN if no object is evaluated.
+ */
+double test_shape_predictor (
+	const ShapePredictor& sp,
+	SampleStream &samples,
+	double (*scale)( const ObjectDetection& ) = NULL
+);
+
+
 }
 
 #endif // DLIB_SHAPE_PREDICToR_H_
@@ -3,6 +3,8 @@
 
 
 #include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cassert>
 #include <ert/ShapePredictor.hh>
 #include <ert/RegressionTree.hh>
 
@@ -13,7 +15,15 @@ namespace ert {
 	using namespace cv;
 
 
-	class Random;
+	class RandomStream;
+
+	class AliasTable;
+
+	class TrainingTelemetry;
+
+	class SampleStorage;
+
+	class ProcessGroup;
 
 	class ShapePredictor;
 
@@ -31,12 +41,13 @@ namespace ert {
 		/*!
 
 		CONVENTION
-			- feature_pixel_values.size() == get_feature_pool_size()
+			- feature_pixel_values points to get_feature_pool_size() values in
+			  the sample storage of the trainer (see SampleStorage)
 			- feature_pixel_values[j] == the value of the j-th feature pool
 			  pixel when you look it up relative to the shape in current_shape.
 
 			- target_shape == The truth shape.  Stays constant during the whole
-			  training process.
+			  training process, so the oversampled copies of an object share it.
 			- rect == the position of the object in the image_idx-th image.  All shape
 			  coordinates are coded relative to this rectangle.
 		!*/
@@ -46,7 +57,11 @@ namespace ert {
 		cv::Mat target_shape;
 
 		cv::Mat current_shape;
-		std::vector<double> feature_pixel_values;
+		uint8_t *feature_pixel_values;
+
+		TrainingSample() : image_idx(0), feature_pixel_values(NULL)
+		{
+		}
 
 		void swap(TrainingSample& item)
 		{
@@ -54,10 +69,44 @@ namespace ert {
 			std::swap(rect, item.rect);
 			cv::swap(target_shape, item.target_shape);
 			cv::swap(current_shape, item.current_shape);
-			feature_pixel_values.swap(item.feature_pixel_values);
+			std::swap(feature_pixel_values, item.feature_pixel_values);
+		}
+
+		/**
+		 * Like swap, but the current shapes and the 'pool_size' feature pixel
+		 * values keep their place in the sample storage and only their contents
+		 * are exchanged, so the samples of a tree node stay in a contiguous
+		 * range of the storage.
+		 */
+		void swap_contents(TrainingSample& item, size_t pool_size)
+		{
+			std::swap(image_idx, item.image_idx);
+			std::swap(rect, item.rect);
+			cv::swap(target_shape, item.target_shape);
+
+			assert(current_shape.isContinuous() && item.current_shape.isContinuous());
+			double *shape = current_shape.ptr<double>();
+			std::swap_ranges(shape, shape + current_shape.total(), item.current_shape.ptr<double>());
+			std::swap_ranges(feature_pixel_values, feature_pixel_values + pool_size, item.feature_pixel_values);
 		}
 	};
 
+	/**
+	 * Training state before the first tree is built: the training samples (with
+	 * the feature pixel values of the first cascade level), the initial shape and
+	 * the feature pools. It depends only on the training data, the random seed,
+	 * the oversampling amount, the feature pool size and the padding, so it can
+	 * be shared by trainers that only differ in the other parameters.
+	 */
+	struct InitialTrainingState
+	{
+		cv::Mat initial_shape;
+		std::vector<std::vector<cv::Point2f> > pixel_coordinates;
+		std::vector<TrainingSample> samples;
+		// holds the feature pixel values of the samples
+		cv::Mat feature_pixel_values;
+	};
+
 		/*PointTransformAffine normalizing_tform (
 			const Rect& rect
 		);*/
@@ -67,6 +116,24 @@ namespace ert {
 	{
 		public:
 
+			/**
+			 * Strategies used to find the best split of a tree node.
+			 */
+			enum SplitStrategy
+			{
+				/**
+				 * Test 'num_test_splits' random pixel pairs with random thresholds.
+				 */
+				SPLIT_RANDOM_THRESHOLD,
+
+				/**
+				 * Test 'num_test_splits' random pixel pairs and use the best
+				 * threshold for each pair, found with an histogram of the pixel
+				 * differences.
+				 */
+				SPLIT_HISTOGRAM
+			};
+
 			ShapePredictorTrainer ( );
 
 			unsigned long get_cascade_depth () const;
@@ -91,6 +158,9 @@ namespace ert {
 
 			std::string get_random_seed () const;
 
+			void set_random_seed (
+				const std::string &seed);
+
 			unsigned long get_oversampling_amount () const;
 
 			void set_oversampling_amount (
@@ -117,6 +187,194 @@ namespace ert {
 			void set_feature_pool_region_padding (
 				double padding);
 
+			SplitStrategy get_split_strategy (
+			) const;
+			void set_split_strategy (
+				SplitStrategy strategy);
+
+			double get_tree_subsampling_fraction (
+			) const;
+
+			/**
+			 * Build each tree from a random fraction of the training samples
+			 * (stochastic gradient boosting). The tree predictions are still
+			 * applied to all samples.
+			 */
+			void set_tree_subsampling_fraction (
+				double fraction);
+
+			unsigned long get_split_subsampling_size (
+			) const;
+
+			/**
+			 * Test the splits of nodes with more than 'size' samples using a
+			 * random subset of 'size' samples. Zero uses all samples.
+			 */
+			void set_split_subsampling_size (
+				unsigned long size);
+
+			unsigned long get_validation_interval (
+			) const;
+
+			/**
+			 * Amount of trees between validation error checks.
+			 */
+			void set_validation_interval (
+				unsigned long trees);
+
+			unsigned long get_early_stopping_patience (
+			) const;
+
+			double get_early_stopping_tolerance (
+			) const;
+
+			/**
+			 * Stop a cascade level after 'patience' validation checks in a row
+			 * that do not reduce the error by more than 'tolerance' (relative).
+			 * A patience of zero disables early stopping.
+			 */
+			void set_early_stopping (
+				unsigned long patience,
+				double tolerance);
+
+			const InitialTrainingState *get_initial_state (
+			) const;
+
+			/**
+			 * Start the training from a state computed by 'prepare_initial_state'
+			 * (with the same training data) instead of computing it again. The
+			 * state must have been prepared with a cascade depth not smaller
+			 * than 'cascade_depth' and must be valid until the training ends.
+			 * The state is not used when resuming or warm-starting the training;
+			 * use NULL to disable it.
+			 */
+			void set_initial_state (
+				const InitialTrainingState *state );
+
+			unsigned long get_num_processes (
+			) const;
+
+			/**
+			 * Build the trees using several processes (created with 'fork'),
+			 * each one with a shard of the training samples. The processes
+			 * exchange the split statistics through shared memory and run
+			 * single-threaded. This mode does not support validation,
+			 * histogram splits, subsampling or checkpoints.
+			 */
+			void set_num_processes (
+				unsigned long processes );
+
+			const std::string &get_spill_directory (
+			) const;
+
+			/**
+			 * Keep the feature pixel values and the current shapes of the
+			 * training samples in memory-mapped temporary files in the given
+			 * directory, so datasets larger than the available memory can be
+			 * used (the operating system moves the least used pages to disk).
+			 * Use an empty string to keep everything in memory.
+			 */
+			void set_spill_directory (
+				const std::string &directory );
+
+			unsigned long get_augmentation_amount (
+			) const;
+
+			/**
+			 * Add the given amount of augmented copies of each training
+			 * object, made at the beginning of the training (in parallel) and
+			 * kept in memory as face crops. Each copy is rotated and scaled by
+			 * random amounts within the rotation and scale jitters and every
+			 * other copy is mirrored (if there is a mirror map). Zero disables
+			 * the augmentation.
+			 */
+			void set_augmentation_amount (
+				unsigned long amount );
+
+			const std::vector<unsigned long> &get_mirror_map (
+			) const;
+
+			/**
+			 * Set the part that each part becomes in mirrored faces (e.g. the
+			 * left eye corner becomes the right eye corner). An empty map
+			 * disables mirroring.
+			 */
+			void set_mirror_map (
+				const std::vector<unsigned long> &map );
+
+			double get_rotation_jitter (
+			) const;
+
+			/**
+			 * Maximum rotation (in degrees) of the augmented copies.
+			 */
+			void set_rotation_jitter (
+				double degrees );
+
+			double get_scale_jitter (
+			) const;
+
+			/**
+			 * Maximum scale change of the augmented copies (e.g. 0.1 scales
+			 * the faces between 90% and 110%).
+			 */
+			void set_scale_jitter (
+				double fraction );
+
+			const std::string &get_telemetry_file (
+			) const;
+
+			/**
+			 * Write training figures as JSON lines to the given file: one line
+			 * per cascade level (time spent in each phase, throughput, peak
+			 * memory and training/validation error) and one line for the whole
+			 * training. Use an empty string to disable.
+			 */
+			void set_telemetry_file (
+				const std::string &fileName );
+
+			const ShapePredictor *get_warm_start (
+			) const;
+
+			/**
+			 * Continue the training from an existing model instead of starting
+			 * from scratch. The model initial shape and feature pools are reused
+			 * and its trees are kept (and applied to the training samples) at the
+			 * beginning of each cascade level. Levels with less trees than
+			 * 'num_trees_per_cascade_level' get more trees and the levels beyond
+			 * the model cascade depth are trained as usual. The training samples
+			 * may come from another dataset (i.e. fine-tuning).
+			 *
+			 * The model must have the same number of parts of the training
+			 * objects, the same feature pool size and a cascade depth not greater
+			 * than 'cascade_depth'. It must be valid until the training ends;
+			 * use NULL to disable warm start.
+			 */
+			void set_warm_start (
+				const ShapePredictor *model );
+
+			const std::string &get_checkpoint_file (
+			) const;
+
+			/**
+			 * Periodically save the training state in the given file. The
+			 * interval is the minimum amount of seconds between checkpoints.
+			 * An empty file name disables checkpoints.
+			 */
+			void set_checkpoint_file (
+				const std::string &fileName,
+				unsigned long interval = 300);
+
+			bool get_resume (
+			) const;
+
+			/**
+			 * If true, 'train' continues from the checkpoint file (if it exists)
+			 * instead of starting from scratch.
+			 */
+			void set_resume (
+				bool resume);
+
 			void be_verbose ();
 
 			void be_quiet ();
@@ -125,8 +383,63 @@ namespace ert {
 				const std::vector<cv::Mat*>& images,
 				const std::vector<std::vector<ObjectDetection*> >& objects ) const;
 
+			/**
+			 * Train one model for each group of parts (given by their indices
+			 * in the objects). The models are trained concurrently and share
+			 * the images; each one gets its share of the threads. The
+			 * checkpoint and telemetry files of each model get the group index
+			 * as suffix.
+			 */
+			std::vector<ShapePredictor> train_part_groups (
+				const std::vector<cv::Mat*>& images,
+				const std::vector<std::vector<ObjectDetection*> >& objects,
+				const std::vector<std::vector<unsigned long> >& part_groups ) const;
+
+			/**
+			 * Compute the initial training state for the given training data.
+			 * The state can be given to other trainers through
+			 * 'set_initial_state'.
+			 */
+			void prepare_initial_state (
+				const std::vector<cv::Mat*>& images,
+				const std::vector<std::vector<ObjectDetection*> >& objects,
+				InitialTrainingState &state ) const;
+
+			/**
+			 * Train using an held-out validation set. The validation error is
+			 * measured every 'validation_interval' trees and each cascade level
+			 * stops once the error stops improving (see 'set_early_stopping').
+			 * The trees after the smallest validation error are discarded, so
+			 * the levels of the resulting model may have less trees than
+			 * 'num_trees_per_cascade_level'.
+			 */
+			ShapePredictor train (
+				const std::vector<cv::Mat*>& images,
+				const std::vector<std::vector<ObjectDetection*> >& objects,
+				const std::vector<cv::Mat*>& validation_images,
+				const std::vector<std::vector<ObjectDetection*> >& validation_objects ) const;
+
 		private:
 
+			/**
+			 * State of the cascade level being trained: the early stopping state
+			 * and the residual sum carried from one tree to the next. It is saved
+			 * in the checkpoints, so a resumed level builds the same trees and
+			 * stops at the same tree.
+			 */
+			struct LevelState
+			{
+				double best_error;
+				double reference_error;
+				unsigned long best_trees;
+				unsigned long checks_without_improvement;
+				cv::Mat residual_sum;
+
+				LevelState() : best_error(0), reference_error(0), best_trees(0), checks_without_improvement(0)
+				{
+				}
+			};
+
 
 			// CHECKED!!!
 			static cv::Mat object_to_shape (
@@ -137,49 +450,267 @@ namespace ert {
 			void printShape( const std::string& prefix, const cv::Mat& mat ) const;
 
 
+			/**
+			 * Create the augmented copies of the training objects. The face
+			 * crops are allocated in 'storage' and the objects in 'holder';
+			 * each copy gets its own entry in 'augmented_images' and
+			 * 'augmented_objects'.
+			 */
+			void augment_training_data (
+				const std::vector<cv::Mat*>& images,
+				const std::vector<std::vector<ObjectDetection*> >& objects,
+				SampleStorage &storage,
+				std::vector<cv::Mat> &crops,
+				std::vector<ObjectDetection> &holder,
+				std::vector<cv::Mat*> &augmented_images,
+				std::vector<std::vector<ObjectDetection*> > &augmented_objects
+			) const;
+
+			/**
+			 * Build the 'tree'-th regression tree of the given cascade level.
+			 * The indices select the random streams used by the tree nodes.
+			 *
+			 * 'residual_sum' is the sum of the residuals of all samples. If
+			 * empty, it is computed here; in any case, it is updated with the
+			 * residuals after the tree is applied, so it can be given to the
+			 * next tree of the level.
+			 */
 			RegressionTree make_regression_tree (
 				std::vector<TrainingSample>& samples,
-				const std::vector<cv::Point2f >& pixel_coordinates
+				const AliasTable& pixel_pairs,
+				unsigned long cascade,
+				unsigned long tree,
+				cv::Mat &residual_sum,
+				TrainingTelemetry &telemetry
 			) const;
 
 			/**
-			 * Create an split feature with randomly generated threshold.
+			 * Build the 'tree'-th regression tree of the given cascade level
+			 * with the processes of the group. Each process gives its own
+			 * samples, in the range [begin, end).
+			 */
+			RegressionTree make_shared_regression_tree (
+				std::vector<TrainingSample>& samples,
+				unsigned long begin,
+				unsigned long end,
+				const AliasTable& pixel_pairs,
+				unsigned long cascade,
+				unsigned long tree,
+				ProcessGroup &group,
+				TrainingTelemetry &telemetry
+			) const;
+
+			/**
+			 * Size of the shared memory used by 'make_shared_regression_tree'.
+			 */
+			size_t compute_shared_tree_size (
+				unsigned long num_parts
+			) const;
+
+			/**
+			 * Create an split feature with randomly generated threshold. The
+			 * pixel pair is drawn from the table built with the weights from
+			 * 'compute_pixel_pair_weights'.
 			 */
 			SplitFeature randomly_generate_split_feature (
+				const AliasTable& pixel_pairs,
+				RandomStream &rnd
+			) const;
+
+			/**
+			 * Compute the probability weights of every ordered pair of distinct
+			 * pixels of the feature pool, according to the exponential prior
+			 * over their distance.
+			 */
+			std::vector<double> compute_pixel_pair_weights (
 				const std::vector<cv::Point2f >& pixel_coordinates
 			) const;
 
 
 			/**
-			 * Generate a bunch of random splits, test them and return the best one.
+			 * Test the given random splits and return the best one. If 'subset'
+			 * is not empty, the splits are tested using only the samples with
+			 * these indices. If 'parallel' is true, the samples of the node are
+			 * split among the threads.
 			 */
 			SplitFeature generate_split (
 				const std::vector<TrainingSample>& samples,
 				unsigned long begin,
 				unsigned long end,
-				const std::vector<cv::Point2f >& pixel_coordinates,
+				const std::vector<unsigned long>& subset,
+				const std::vector<SplitFeature>& feats,
+				const cv::Mat& sum,
+				cv::Mat& left_sum,
+				cv::Mat& right_sum,
+				bool parallel
+			) const;
+
+			/**
+			 * Test the given random splits (with their thresholds) and return
+			 * the best one.
+			 */
+			SplitFeature find_best_split (
+				const std::vector<TrainingSample>& samples,
+				unsigned long begin,
+				unsigned long end,
+				const std::vector<unsigned long>& subset,
+				const std::vector<SplitFeature>& feats,
+				const cv::Mat& sum,
+				cv::Mat& left_sum,
+				bool parallel
+			) const;
+
+			/**
+			 * For each one of the given pixel pairs, build an histogram of the
+			 * pixel differences and find the best threshold. Returns the best
+			 * pair with its threshold.
+			 */
+			SplitFeature find_best_histogram_split (
+				const std::vector<TrainingSample>& samples,
+				unsigned long begin,
+				unsigned long end,
+				const std::vector<unsigned long>& subset,
+				const std::vector<SplitFeature>& feats,
 				const cv::Mat& sum,
 				cv::Mat& left_sum,
-				cv::Mat& right_sum
+				bool parallel
 			) const;
 
 			/**
 			 * Splits samples based on split (sorta like in quick sort) and returns the mid
 			 * point.  make sure you return the mid in a way compatible with how we walk
-			 * through the tree.
+			 * through the tree. With 'move_contents' the samples are swapped
+			 * with TrainingSample::swap_contents, so the nodes stay contiguous in
+			 * the sample storage. Otherwise only the headers are swapped and the
+			 * storage rows stay with their samples (which the other processes of
+			 * a group rely on).
 			 */
 			unsigned long partition_samples (
 				const SplitFeature& split,
 				std::vector<TrainingSample>& samples,
 				unsigned long begin,
-				unsigned long end
+				unsigned long end,
+				bool move_contents
 			) const;
 
 
 
+			/**
+			 * Save the training state in the checkpoint file. The state includes
+			 * the first 'trees' trees of the given cascade level, whether the
+			 * level is finished and the state of the level.
+			 */
+			void save_checkpoint (
+				const cv::Mat &initial_shape,
+				const std::vector<std::vector<cv::Point2f> > &pixel_coordinates,
+				const std::vector<std::vector<RegressionTree> > &forests,
+				const std::vector<TrainingSample> &samples,
+				unsigned long cascade,
+				unsigned long trees,
+				bool finished,
+				const LevelState &level
+			) const;
+
+			/**
+			 * Load the training state from the checkpoint file. Returns false if
+			 * the file does not exist.
+			 */
+			bool load_checkpoint (
+				cv::Mat &initial_shape,
+				std::vector<std::vector<cv::Point2f> > &pixel_coordinates,
+				std::vector<std::vector<RegressionTree> > &forests,
+				std::vector<TrainingSample> &samples,
+				SampleStorage &storage,
+				unsigned long &cascade,
+				unsigned long &trees,
+				bool &finished,
+				LevelState &level
+			) const;
+
+			/**
+			 * Write/check the parameters that must not change when resuming.
+			 */
+			void serialize_parameters (
+				std::ostream &out
+			) const;
+
+			bool check_parameters (
+				std::istream &in
+			) const;
+
+			/**
+			 * Replace the initial shape, feature pools and forests with the ones
+			 * from the warm start model. The feature pools of the other levels
+			 * are sampled again around the model initial shape.
+			 */
+			void prepare_warm_start (
+				const ShapePredictor &model,
+				cv::Mat &initial_shape,
+				std::vector<std::vector<cv::Point2f> > &pixel_coordinates,
+				std::vector<std::vector<RegressionTree> > &forests,
+				std::vector<TrainingSample> &samples
+			) const;
+
+			/**
+			 * Compute the feature pixel values of the samples using the given
+			 * feature pool.
+			 */
+			void extract_feature_pixel_values (
+				const std::vector<cv::Mat*>& images,
+				std::vector<TrainingSample>& samples,
+				const cv::Mat& initial_shape,
+				const std::vector<cv::Point2f>& pixel_coordinates,
+				unsigned long begin = 0,
+				unsigned long end = (unsigned long) -1
+			) const;
+
+			/**
+			 * Add the tree predictions (times 'scale') to the samples' current
+			 * shapes.
+			 */
+			void apply_tree (
+				const RegressionTree& tree,
+				std::vector<TrainingSample>& samples,
+				double scale = 1,
+				unsigned long begin = 0,
+				unsigned long end = (unsigned long) -1
+			) const;
+
+			/**
+			 * Mean distance between the current and target shapes points.
+			 */
+			static double compute_error (
+				const std::vector<TrainingSample>& samples );
+
+			void populate_validation_samples (
+				const std::vector<std::vector<ObjectDetection*> >& objects,
+				const cv::Mat& initial_shape,
+				std::vector<TrainingSample>& samples,
+				SampleStorage &storage
+			) const;
+
+			/**
+			 * Move the current shapes of the samples to a single buffer of the
+			 * given storage.
+			 */
+			void allocate_current_shapes (
+				std::vector<TrainingSample>& samples,
+				SampleStorage &storage
+			) const;
+
+			/**
+			 * Move the feature pixel values of the samples (if any) to a single
+			 * buffer of the given storage and return it.
+			 */
+			cv::Mat allocate_feature_pixel_values (
+				std::vector<TrainingSample>& samples,
+				SampleStorage &storage
+			) const;
+
 			cv::Mat populate_training_sample_shapes(
 				const std::vector<std::vector<ObjectDetection*> >& objects,
-				std::vector<TrainingSample>& samples
+				std::vector<TrainingSample>& samples,
+				SampleStorage &storage
 			) const;
 
 
@@ -188,14 +719,14 @@ namespace ert {
 				const double min_x,
 				const double min_y,
 				const double max_x,
-				const double max_y
+				const double max_y,
+				RandomStream &rnd
 			) const;
 
 			std::vector<std::vector<cv::Point2f > > randomly_sample_pixel_coordinates (
 				const cv::Mat& initial_shape ) const;
 
-			Random *rnd;
-
+			std::string _random_seed;
 			unsigned long _cascade_depth;
 			unsigned long _tree_depth;
 			unsigned long _num_trees_per_cascade_level;
@@ -205,6 +736,26 @@ namespace ert {
 			double _lambda;
 			unsigned long _num_test_splits;
 			double _feature_pool_region_padding;
+			SplitStrategy _split_strategy;
+			double _tree_subsampling_fraction;
+			unsigned long _split_subsampling_size;
+			const ShapePredictor *_warm_start;
+			unsigned long _augmentation_amount;
+			// the training lists already include the augmented copies
+			bool _augmented;
+			std::vector<unsigned long> _mirror_map;
+			double _rotation_jitter;
+			double _scale_jitter;
+			std::string _telemetry_file;
+			std::string _spill_directory;
+			unsigned long _num_processes;
+			const InitialTrainingState *_initial_state;
+			unsigned long _validation_interval;
+			unsigned long _early_stopping_patience;
+			double _early_stopping_tolerance;
+			std::string _checkpoint_file;
+			unsigned long _checkpoint_interval;
+			bool _resume;
 			bool _verbose;
 		};
 
@@ -23,6 +23,17 @@ cv::Point2f operator/(
 	size_t i );
 
 
+/**
+ * Convert a BGR image to gray using the average of the three channels, i.e.
+ * (B+G+R)/3 rounded to the nearest integer. Single channel images are just
+ * copied and the fourth channel of BGRA images is ignored. The output buffer
+ * is reused if it already has the right size.
+ */
+void bgr_to_gray(
+	const cv::Mat &input,
+	cv::Mat &output );
+
+
 };
 
 
@@ -0,0 +1,67 @@
+#include "AliasTable.hh"
+#include <stdexcept>
+
+
+namespace ert {
+
+
+AliasTable::AliasTable(
+	const std::vector<double> &weights )
+{
+	const size_t count = weights.size();
+	double total = 0;
+	for (size_t i = 0; i < count; ++i)
+		total += weights[i];
+	if (count == 0 || !(total > 0))
+		throw std::runtime_error("The alias table needs at least one positive weight");
+
+	probability.resize(count);
+	alias.resize(count);
+
+	// Vose's algorithm: scale the weights so the average is 1, then pair each
+	// entry below the average with one above it
+	std::vector<uint32_t> small, large;
+	for (size_t i = 0; i < count; ++i)
+	{
+		probability[i] = weights[i] * count / total;
+		alias[i] = (uint32_t) i;
+		if (probability[i] < 1)
+			small.push_back((uint32_t) i);
+		else
+			large.push_back((uint32_t) i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		uint32_t less = small.back();
+		uint32_t more = large.back();
+		small.pop_back();
+
+		alias[less] = more;
+		probability[more] -= 1 - probability[less];
+		if (probability[more] < 1)
+		{
+			large.pop_back();
+			small.push_back(more);
+		}
+	}
+
+	// the remaining entries are (up to rounding errors) exactly 1
+	for (size_t i = 0; i < small.size(); ++i)
+		probability[small[i]] = 1;
+	for (size_t i = 0; i < large.size(); ++i)
+		probability[large[i]] = 1;
+}
+
+
+unsigned long AliasTable::sample(
+	RandomStream &rnd ) const
+{
+	const unsigned long index = (unsigned long) (rnd.get_random_64bit_number() % probability.size());
+	if (rnd.get_random_double() < probability[index])
+		return index;
+	return alias[index];
+}
+
+
+}
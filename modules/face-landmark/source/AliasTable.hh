@@ -0,0 +1,44 @@
+#ifndef FA_LANDMARK_ERT_ALIAS_TABLE_HH
+#define FA_LANDMARK_ERT_ALIAS_TABLE_HH
+
+#include <vector>
+#include <stdint.h>
+#include "RandomStream.hh"
+
+namespace ert
+{
+
+
+/**
+ * Draws indices from a fixed discrete distribution in constant time (Walker's
+ * alias method).
+ *
+ *     AliasTable table(weights);
+ *     unsigned long index = table.sample(rnd);
+ *
+ * Index 'i' is drawn with probability weights[i] / sum(weights). The table
+ * is read-only after construction, so it can be shared by many threads.
+ */
+class AliasTable
+{
+	public:
+		AliasTable(
+			const std::vector<double> &weights );
+
+		unsigned long sample(
+			RandomStream &rnd ) const;
+
+		unsigned long size() const
+		{
+			return (unsigned long) probability.size();
+		}
+
+	private:
+		std::vector<double> probability;
+		std::vector<uint32_t> alias;
+};
+
+
+}
+
+#endif // FA_LANDMARK_ERT_ALIAS_TABLE_HH
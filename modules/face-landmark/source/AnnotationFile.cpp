@@ -0,0 +1,225 @@
+#include <ert/AnnotationFile.hh>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace ert {
+
+
+/*
+ * The file starts with a header and the index (one entry per image, sorted by
+ * path), followed by the paths and the part coordinates (X and Y of each part
+ * as floats) of every image.
+ */
+static const char ANNOTATION_MAGIC[8] = { 'E', 'R', 'T', 'A', 'N', 'N', 'O', 'T' };
+
+static const uint32_t ANNOTATION_VERSION = 1;
+
+struct AnnotationHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct AnnotationEntry
+{
+	uint64_t nameOffset;
+	uint64_t partsOffset;
+	uint32_t nameLength;
+	uint32_t parts;
+};
+
+
+/*
+ * Check that 'size' bytes starting at 'offset' are inside a file of
+ * 'fileSize' bytes (without overflowing).
+ */
+static bool annotationFits( uint64_t offset, uint64_t size, uint64_t fileSize )
+{
+	return offset <= fileSize && size <= fileSize - offset;
+}
+
+
+AnnotationFile::AnnotationFile(
+	const std::string &fileName ) : data(NULL), dataSize(0), count(0)
+{
+#if defined(__unix__) || defined(__APPLE__)
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Unable to open the annotation file " + fileName);
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(AnnotationHeader))
+	{
+		close(fd);
+		throw std::runtime_error("Invalid annotation file " + fileName);
+	}
+	dataSize = info.st_size;
+	data = mmap(NULL, dataSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		data = NULL;
+		throw std::runtime_error("Unable to map the annotation file " + fileName);
+	}
+#else
+	throw std::runtime_error("Annotation files are not supported in this platform");
+#endif
+
+	// The entries are checked once here, so 'find' and 'getImageFileName'
+	// can use them as they are: the paths and the parts must be inside the
+	// file, and the parts aligned for reading floats.
+	const AnnotationHeader &header = *(const AnnotationHeader*) data;
+	bool valid = std::memcmp(header.magic, ANNOTATION_MAGIC, sizeof(ANNOTATION_MAGIC)) == 0 &&
+		header.version == ANNOTATION_VERSION &&
+		annotationFits(sizeof(header), (uint64_t) header.count * sizeof(AnnotationEntry), dataSize);
+	const AnnotationEntry *index = (const AnnotationEntry*) ((const uint8_t*) data + sizeof(header));
+	for (uint32_t i = 0; valid && i < header.count; ++i)
+	{
+		const AnnotationEntry &entry = index[i];
+		valid = annotationFits(entry.nameOffset, entry.nameLength, dataSize) &&
+			entry.partsOffset % sizeof(float) == 0 &&
+			annotationFits(entry.partsOffset, (uint64_t) entry.parts * 2 * sizeof(float), dataSize);
+	}
+	if (!valid)
+	{
+#if defined(__unix__) || defined(__APPLE__)
+		munmap(data, dataSize);
+#endif
+		data = NULL;
+		throw std::runtime_error("Invalid annotation file " + fileName);
+	}
+	count = header.count;
+}
+
+
+AnnotationFile::~AnnotationFile()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	if (data != NULL)
+		munmap(data, dataSize);
+#endif
+}
+
+
+size_t AnnotationFile::size() const
+{
+	return count;
+}
+
+
+std::string AnnotationFile::getImageFileName(
+	size_t index ) const
+{
+	const uint8_t *bytes = (const uint8_t*) data;
+	const AnnotationEntry &entry = ((const AnnotationEntry*) (bytes + sizeof(AnnotationHeader)))[index];
+	return std::string((const char*) bytes + entry.nameOffset, entry.nameLength);
+}
+
+
+bool AnnotationFile::find(
+	const std::string &imageFileName,
+	ObjectDetection &annot ) const
+{
+	const uint8_t *bytes = (const uint8_t*) data;
+	const AnnotationEntry *index = (const AnnotationEntry*) (bytes + sizeof(AnnotationHeader));
+
+	// binary search by path (same order as std::string comparison)
+	size_t first = 0, last = count;
+	while (first < last)
+	{
+		const size_t middle = first + (last - first) / 2;
+		const AnnotationEntry &entry = index[middle];
+		const size_t length = std::min((size_t) entry.nameLength, imageFileName.length());
+		int result = std::memcmp(bytes + entry.nameOffset, imageFileName.c_str(), length);
+		if (result == 0)
+			result = (entry.nameLength < imageFileName.length()) ? -1 :
+				(entry.nameLength > imageFileName.length()) ? 1 : 0;
+
+		if (result < 0)
+			first = middle + 1;
+		else
+		if (result > 0)
+			last = middle;
+		else
+		{
+			const float *values = (const float*) (bytes + entry.partsOffset);
+			std::vector<Point2f> parts(entry.parts);
+			for (uint32_t i = 0; i < entry.parts; ++i)
+				parts[i] = Point2f(values[i * 2], values[i * 2 + 1]);
+			annot = ObjectDetection(Rect(), parts);
+			annot.computeBoundingBox(0.1);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void AnnotationFile::save(
+	const std::string &fileName,
+	const std::vector<std::string> &imageFileNames,
+	const std::vector<ObjectDetection> &annotations )
+{
+	if (imageFileNames.size() != annotations.size())
+		throw std::runtime_error("The number of images and annotations must be the same");
+
+	std::vector<std::pair<std::string, size_t> > order(imageFileNames.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = std::make_pair(imageFileNames[i], i);
+	std::sort(order.begin(), order.end());
+
+	AnnotationHeader header;
+	std::memcpy(header.magic, ANNOTATION_MAGIC, sizeof(ANNOTATION_MAGIC));
+	header.version = ANNOTATION_VERSION;
+	header.count = (uint32_t) order.size();
+
+	// the part coordinates come first (aligned) and the paths at the end
+	std::vector<AnnotationEntry> index(order.size());
+	uint64_t offset = sizeof(header) + index.size() * sizeof(AnnotationEntry);
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		index[i].partsOffset = offset;
+		index[i].parts = (uint32_t) annotations[order[i].second].num_parts();
+		offset += index[i].parts * 2 * sizeof(float);
+	}
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		index[i].nameOffset = offset;
+		index[i].nameLength = (uint32_t) order[i].first.length();
+		offset += index[i].nameLength;
+	}
+
+	std::ofstream output(fileName.c_str(), std::ios::binary);
+	if (!output.good())
+		throw std::runtime_error("Unable to create the annotation file " + fileName);
+	output.write((const char*) &header, sizeof(header));
+	if (!index.empty())
+		output.write((const char*) &index[0], index.size() * sizeof(AnnotationEntry));
+	for (size_t i = 0; i < order.size(); ++i)
+	{
+		const ObjectDetection &annot = annotations[order[i].second];
+		for (unsigned long j = 0; j < annot.num_parts(); ++j)
+		{
+			const float values[2] = { annot.part(j).x, annot.part(j).y };
+			output.write((const char*) values, sizeof(values));
+		}
+	}
+	for (size_t i = 0; i < order.size(); ++i)
+		output.write(order[i].first.c_str(), order[i].first.length());
+
+	if (!output.good())
+		throw std::runtime_error("Unable to write the annotation file " + fileName);
+}
+
+
+} // namespace ert
@@ -1,4 +1,6 @@
 #include <ert/ObjectDetection.hh>
+#include <stdexcept>
+#include <cstdlib>
 
 
 namespace ert {
@@ -87,7 +89,7 @@ void ObjectDetection::save( const std::string& fileName ) const
 
 void ObjectDetection::loadPoints( const std::string &fileName )
 {
-	char *line;
+	char *line = NULL;
 	size_t len = 0;
 	float x, y;
 	int lines = 0;
@@ -115,6 +117,7 @@ void ObjectDetection::loadPoints( const std::string &fileName )
 		}
 	}
 	fclose(fp);
+	free(line);
 }
 
 void ObjectDetection::load(
@@ -225,4 +228,18 @@ void ObjectDetection::remove( size_t from, size_t to )
 }
 
 
+ObjectDetection ObjectDetection::subset(
+	const std::vector<unsigned long> &indices ) const
+{
+	std::vector<Point2f> selected(indices.size());
+	for (size_t i = 0; i < indices.size(); ++i)
+	{
+		if (indices[i] >= num_parts())
+			throw std::out_of_range("Invalid object part index");
+		selected[i] = parts[indices[i]];
+	}
+	return ObjectDetection(rect, selected);
+}
+
+
 } // namespace ert
@@ -0,0 +1,226 @@
+#include "ProcessGroup.hh"
+#include <stdexcept>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+namespace ert {
+
+
+/**
+ * Interval (in milliseconds) at which the processes waiting in a barrier check
+ * that the other processes are still alive.
+ */
+static const long LIVENESS_INTERVAL = 200;
+
+
+/**
+ * Barrier state, stored in the beginning of the shared segment.
+ */
+struct ProcessGroup::Control
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t condition;
+	int waiting;
+	int generation;
+	int failed;
+};
+
+
+ProcessGroup::ProcessGroup(
+	int processes,
+	size_t shared_size ) : rank(0), size(processes), control(NULL), shared(NULL),
+		finished(false)
+{
+	if (processes < 1)
+		throw std::runtime_error("A process group needs at least one process");
+
+	// the user area starts after the control block, well aligned
+	const size_t header = (sizeof(Control) + 63) / 64 * 64;
+	mapping_size = header + shared_size;
+	void *data = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (data == MAP_FAILED)
+		throw std::runtime_error("Unable to allocate the shared memory of the process group");
+	control = (Control*) data;
+	shared = (char*) data + header;
+
+	pthread_mutexattr_t mutexAttr;
+	pthread_mutexattr_init(&mutexAttr);
+	pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+	// a process killed while holding the mutex must not block the others
+	pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+#endif
+	pthread_mutex_init(&control->mutex, &mutexAttr);
+	pthread_mutexattr_destroy(&mutexAttr);
+
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&control->condition, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+
+	control->waiting = control->generation = control->failed = 0;
+
+	coordinator = getpid();
+	for (int i = 1; i < processes; ++i)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			rank = i;
+			workers.clear();
+			return;
+		}
+		if (pid < 0)
+		{
+			abort();
+			for (size_t j = 0; j < workers.size(); ++j)
+				waitpid(workers[j], NULL, 0);
+			munmap(data, mapping_size);
+			throw std::runtime_error("Unable to create the worker processes");
+		}
+		workers.push_back(pid);
+	}
+}
+
+
+ProcessGroup::~ProcessGroup()
+{
+	if (!finished)
+	{
+		// something went wrong in this process
+		abort();
+		if (rank != 0) _exit(EXIT_FAILURE);
+		for (size_t i = 0; i < workers.size(); ++i)
+			waitpid(workers[i], NULL, 0);
+	}
+	munmap(control, mapping_size);
+}
+
+
+/**
+ * Handles the result of locking the mutex: if its owner died, the group is
+ * marked as failed (the shared state may be inconsistent).
+ */
+static void recover_mutex(
+	int result,
+	pthread_mutex_t *mutex,
+	int *failed )
+{
+#ifdef __linux__
+	if (result == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(mutex);
+		*failed = 1;
+	}
+#else
+	(void) result;
+	(void) mutex;
+	(void) failed;
+#endif
+}
+
+
+void ProcessGroup::lock()
+{
+	recover_mutex(pthread_mutex_lock(&control->mutex), &control->mutex, &control->failed);
+}
+
+
+bool ProcessGroup::alive()
+{
+	// the workers check the coordinator (they are adopted by another
+	// process when it dies) and the coordinator checks every worker
+	if (rank != 0)
+		return getppid() == coordinator;
+
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		int status = 0;
+		// the workers only exit in 'finish', after the last barrier (once
+		// reaped, 'waitpid' fails for the worker, so 'finish' fails too)
+		if (waitpid(workers[i], &status, WNOHANG) != 0)
+			return false;
+	}
+	return true;
+}
+
+
+void ProcessGroup::barrier()
+{
+	lock();
+	const int generation = control->generation;
+	if (++control->waiting == size)
+	{
+		control->waiting = 0;
+		++control->generation;
+		pthread_cond_broadcast(&control->condition);
+	}
+	else
+	{
+		// A process killed by a signal never calls 'abort', so the waiting
+		// processes wake up from time to time to check the others.
+		while (generation == control->generation && !control->failed)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LIVENESS_INTERVAL * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			const int result = pthread_cond_timedwait(&control->condition, &control->mutex, &deadline);
+			recover_mutex(result, &control->mutex, &control->failed);
+			if (result == ETIMEDOUT && !alive())
+			{
+				control->failed = 1;
+				pthread_cond_broadcast(&control->condition);
+			}
+		}
+	}
+	const bool failed = control->failed != 0;
+	pthread_mutex_unlock(&control->mutex);
+
+	if (failed)
+		throw std::runtime_error("A process of the group failed");
+}
+
+
+void ProcessGroup::abort()
+{
+	lock();
+	control->failed = 1;
+	pthread_cond_broadcast(&control->condition);
+	pthread_mutex_unlock(&control->mutex);
+}
+
+
+void ProcessGroup::finish()
+{
+	finished = true;
+	if (rank != 0)
+	{
+		// skip the destructors of the data copied from the coordinator
+		_exit(EXIT_SUCCESS);
+	}
+
+	bool success = true;
+	for (size_t i = 0; i < workers.size(); ++i)
+	{
+		int status = 0;
+		if (waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+			success = false;
+	}
+	workers.clear();
+	if (!success)
+		throw std::runtime_error("A process of the group failed");
+}
+
+
+}
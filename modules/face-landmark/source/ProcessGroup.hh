@@ -0,0 +1,105 @@
+#ifndef FA_LANDMARK_ERT_PROCESS_GROUP_HH
+#define FA_LANDMARK_ERT_PROCESS_GROUP_HH
+
+#include <cstddef>
+#include <vector>
+#include <sys/types.h>
+
+namespace ert
+{
+
+
+/**
+ * Group of processes (created with 'fork') sharing a memory segment.
+ *
+ *     ProcessGroup group(4, sizeof(double) * 1024);
+ *     double *data = (double*) group.get_shared();
+ *     data[group.get_rank()] = compute_something();
+ *     group.barrier();
+ *     if (group.get_rank() == 0) ...
+ *     group.finish();
+ *
+ * The constructor returns in every process of the group with a different
+ * rank; the process that created the group has rank zero (the coordinator).
+ * The other processes (workers) terminate in 'finish' and the coordinator
+ * waits for them there.
+ *
+ * If a process fails (i.e. calls 'abort', is destroyed without calling
+ * 'finish' or is killed) the processes waiting in a barrier throw an
+ * exception. Dead processes are noticed within a fraction of a second.
+ */
+class ProcessGroup
+{
+	public:
+		ProcessGroup(
+			int processes,
+			size_t shared_size );
+
+		~ProcessGroup();
+
+		int get_rank() const
+		{
+			return rank;
+		}
+
+		int get_size() const
+		{
+			return size;
+		}
+
+		/**
+		 * Returns the shared memory segment (zero-filled in the beginning).
+		 */
+		void *get_shared()
+		{
+			return shared;
+		}
+
+		/**
+		 * Waits until every process of the group calls this function.
+		 */
+		void barrier();
+
+		/**
+		 * Marks the group as failed, waking up the processes in a barrier.
+		 */
+		void abort();
+
+		/**
+		 * Terminates the workers. In the coordinator, waits for the workers
+		 * and throws an exception if any of them failed.
+		 */
+		void finish();
+
+	private:
+		struct Control;
+
+		/**
+		 * Locks the shared mutex, marking the group as failed if the
+		 * process holding it died.
+		 */
+		void lock();
+
+		/**
+		 * Checks that the other processes are still running.
+		 */
+		bool alive();
+
+		int rank;
+		int size;
+		Control *control;
+		void *shared;
+		size_t mapping_size;
+		std::vector<pid_t> workers;
+		pid_t coordinator;
+		bool finished;
+
+		ProcessGroup( const ProcessGroup & );
+
+		ProcessGroup &operator=( const ProcessGroup & );
+};
+
+
+}
+
+#endif // FA_LANDMARK_ERT_PROCESS_GROUP_HH
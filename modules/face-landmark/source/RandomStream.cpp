@@ -0,0 +1,75 @@
+#include "RandomStream.hh"
+
+
+namespace ert {
+
+
+/**
+ * Increment of the SplitMix64 generator (golden ratio).
+ */
+static const uint64_t GOLDEN_GAMMA = 0x9E3779B97F4A7C15ULL;
+
+
+RandomStream::RandomStream(
+	uint64_t seed,
+	uint64_t domain,
+	uint64_t key1,
+	uint64_t key2,
+	uint64_t key3 )
+{
+	// chain the keys through the mixing function so streams with different
+	// keys (or the same keys in a different order) are unrelated
+	key = mix(seed + GOLDEN_GAMMA);
+	key = mix(key ^ (domain + GOLDEN_GAMMA));
+	key = mix(key ^ (key1 + GOLDEN_GAMMA));
+	key = mix(key ^ (key2 + GOLDEN_GAMMA));
+	key = mix(key ^ (key3 + GOLDEN_GAMMA));
+	counter = 0;
+}
+
+
+uint64_t RandomStream::mix(
+	uint64_t value )
+{
+	// SplitMix64 finalizer
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+	return value ^ (value >> 31);
+}
+
+
+uint64_t RandomStream::get_random_64bit_number()
+{
+	++counter;
+	return mix(key + counter * GOLDEN_GAMMA);
+}
+
+
+uint32_t RandomStream::get_random_32bit_number()
+{
+	return (uint32_t) (get_random_64bit_number() >> 32);
+}
+
+
+double RandomStream::get_random_double()
+{
+	// use the upper 53 bits as the mantissa
+	return (double) (get_random_64bit_number() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+uint64_t RandomStream::hash_seed(
+	const std::string &seed )
+{
+	// FNV-1a
+	uint64_t value = 0xCBF29CE484222325ULL;
+	for (size_t i = 0; i < seed.length(); ++i)
+	{
+		value ^= (uint8_t) seed[i];
+		value *= 0x100000001B3ULL;
+	}
+	return mix(value);
+}
+
+
+} // namespace ert
@@ -0,0 +1,70 @@
+#ifndef FA_LANDMARK_ERT_RANDOM_STREAM_HH
+#define FA_LANDMARK_ERT_RANDOM_STREAM_HH
+
+#include <string>
+#include <stdint.h>
+
+namespace ert
+{
+
+
+/**
+ * Counter-based pseudo-random number generator.
+ *
+ *     RandomStream rnd(seed, RandomStream::SPLITS, cascade, tree, node);
+ *     uint32_t value = rnd.get_random_32bit_number();
+ *
+ * Each stream is identified by a seed, a domain and up to three keys. The n-th
+ * number of a stream depends only on these values (i.e. there is no shared
+ * state), so streams can be created in any thread and in any order and always
+ * produce the same sequence.
+ */
+class RandomStream
+{
+	public:
+		/**
+		 * Separates the streams used for each purpose in the trainer.
+		 */
+		enum Domain
+		{
+			INITIAL_SHAPES = 1,
+			PIXEL_COORDINATES = 2,
+			SPLITS = 3,
+			SUBSAMPLING = 4,
+			AUGMENTATION = 5
+		};
+
+		RandomStream(
+			uint64_t seed,
+			uint64_t domain,
+			uint64_t key1 = 0,
+			uint64_t key2 = 0,
+			uint64_t key3 = 0 );
+
+		uint32_t get_random_32bit_number();
+
+		uint64_t get_random_64bit_number();
+
+		/**
+		 * Returns a random number in the range [0, 1).
+		 */
+		double get_random_double();
+
+		/**
+		 * Converts a seed string into the numeric seed used by the streams.
+		 */
+		static uint64_t hash_seed(
+			const std::string &seed );
+
+	private:
+		uint64_t key;
+		uint64_t counter;
+
+		static uint64_t mix(
+			uint64_t value );
+};
+
+
+}
+
+#endif // FA_LANDMARK_ERT_RANDOM_STREAM_HH
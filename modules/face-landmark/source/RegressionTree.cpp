@@ -30,18 +30,15 @@ void SplitFeature::deserialize( std::istream &in )
 }
 
 
-const cv::Mat& RegressionTree::operator()(
-	const std::vector<double>& feature_pixel_values
-) const
+template <typename T>
+static unsigned long find_leaf(
+	const std::vector<SplitFeature> &splits,
+	const T &feature_pixel_values )
 /*!
 	requires
 		- All the index values in splits are less than feature_pixel_values.size()
-		- leaf_values.size() is a power of 2.
-		  (i.e. we require a tree with all the levels fully filled out.
-		- leaf_values.size() == splits.size()+1
-		  (i.e. there needs to be the right number of leaves given the number of splits in the tree)
 	ensures
-		- runs through the tree and returns the vector at the leaf we end up in.
+		- runs through the tree and returns the index of the leaf we end up in.
 !*/
 {
 	unsigned long i = 0;
@@ -52,7 +49,33 @@ const cv::Mat& RegressionTree::operator()(
 		else
 			i = right_child(i);
 	}
-	return leaf_values[i - splits.size()];
+	return i - splits.size();
+}
+
+
+const cv::Mat& RegressionTree::operator()(
+	const std::vector<double>& feature_pixel_values
+) const
+/*!
+	requires
+		- All the index values in splits are less than feature_pixel_values.size()
+		- leaf_values.size() is a power of 2.
+		  (i.e. we require a tree with all the levels fully filled out.
+		- leaf_values.size() == splits.size()+1
+		  (i.e. there needs to be the right number of leaves given the number of splits in the tree)
+	ensures
+		- runs through the tree and returns the vector at the leaf we end up in.
+!*/
+{
+	return leaf_values[find_leaf(splits, feature_pixel_values)];
+}
+
+
+const cv::Mat& RegressionTree::operator()(
+	const uint8_t *feature_pixel_values
+) const
+{
+	return leaf_values[find_leaf(splits, feature_pixel_values)];
 }
 
 
@@ -1,52 +1,201 @@
 #include <ert/SampleList.hh>
+#include <ert/opencv.hh>
+#include <ert/AnnotationFile.hh>
 #include <fstream>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 namespace ert {
 
 
-BasicSampleLoader::BasicSampleLoader()
+/*
+ * The cache file starts with a header and an index with one entry per sample.
+ * The data of each sample (file name, rect, parts and image pixels) is stored
+ * at the offset given by its entry, aligned to 16 bytes.
+ */
+static const char CACHE_MAGIC[8] = { 'E', 'R', 'T', 'C', 'A', 'C', 'H', 'E' };
+
+static const uint32_t CACHE_VERSION = 1;
+
+struct CacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+};
+
+struct CacheEntry
+{
+	uint64_t offset;
+	int32_t rows;
+	int32_t cols;
+	int32_t type;
+	int32_t parts;
+	int32_t nameLength;
+	int32_t rect[4];
+};
+
+
+static uint64_t cacheAlign( uint64_t offset )
 {
+	return (offset + 15) & ~((uint64_t) 15);
 }
 
-BasicSampleLoader::~BasicSampleLoader()
+
+/*
+ * Check that 'size' bytes starting at 'offset' are inside a file of
+ * 'fileSize' bytes (without overflowing).
+ */
+static bool cacheFits( uint64_t offset, uint64_t size, uint64_t fileSize )
 {
+	return offset <= fileSize && size <= fileSize - offset;
 }
 
 
-void BasicSampleLoader::load(
+/*
+ * Write the given data at the offset 'target', padding with zeros from the
+ * current position.
+ */
+static void cacheWrite(
+	std::ostream &output,
+	uint64_t &position,
+	uint64_t target,
+	const void *data,
+	size_t size )
+{
+	static const char padding[16] = { 0 };
+	output.write(padding, target - position);
+	if (size > 0)
+		output.write((const char*) data, size);
+	position = target + size;
+}
+
+
+void SampleLoader::loadAnnotations(
 	const std::string &imageFileName,
-	cv::Mat &image,
-	ObjectDetection &annot )
+	ObjectDetection &annot ) const
 {
-	// load the image
-#if (0)
-	cv::cvtColor(imread(line), image, CV_BGR2GRAY);
-#else
-	cv::Mat temp[3];
-	cv::split(imread(imageFileName), temp);
-	temp[0].convertTo(temp[0], CV_32F);
-	temp[1].convertTo(temp[1], CV_32F);
-	temp[2].convertTo(temp[2], CV_32F);
-	image = temp[0] + temp[1] + temp[2];
-	image /= 3.0;
-	image.convertTo(image, CV_8U);
-#endif
-	// load the annotations
+	if (annotationFile != NULL)
+	{
+		if (!annotationFile->find(imageFileName, annot))
+		{
+			#pragma omp critical
+			std::cout << "   No annotations for " << imageFileName << std::endl;
+		}
+		return;
+	}
+
 	std::string pointsFile = SampleList::changeExtension(imageFileName, "pts");
 	try
 	{
 		annot.load(pointsFile);
 	} catch (...)
 	{
+		#pragma omp critical
 		std::cout << "   Ignoring file " << pointsFile << std::endl;
 	}
 }
 
+
+double SampleLoader::readImage(
+	const std::string &imageFileName,
+	const ObjectDetection &annot,
+	cv::Mat &image ) const
+{
+	const Rect &box = annot.get_rect();
+	double scale = 1;
+	if (faceSize > 0 && box.width > 0 && box.height > 0)
+		scale = (double) faceSize / std::max(box.width, box.height);
+
+	// the decoder can reduce JPEG images by 2, 4 or 8 almost for free
+	int reduction = 1;
+	cv::Mat source;
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 2)
+	while (reduction < 8 && scale * reduction * 2 <= 1)
+		reduction *= 2;
+	if (reduction == 8)
+		source = cv::imread(imageFileName, cv::IMREAD_REDUCED_COLOR_8);
+	else
+	if (reduction == 4)
+		source = cv::imread(imageFileName, cv::IMREAD_REDUCED_COLOR_4);
+	else
+	if (reduction == 2)
+		source = cv::imread(imageFileName, cv::IMREAD_REDUCED_COLOR_2);
+	else
+#endif
+		source = cv::imread(imageFileName);
+	if (source.empty())
+		throw std::runtime_error("Unable to read the image " + imageFileName);
+
+	bgr_to_gray(source, image);
+	source.release();
+
+	// the decoder reductions are powers of two, so we scale what is left
+	const double remaining = scale * reduction;
+	if (remaining < 1)
+	{
+		cv::Mat temp;
+		cv::resize(image, temp, cv::Size(), remaining, remaining, cv::INTER_AREA);
+		image = temp;
+		return scale;
+	}
+	return 1.0 / reduction;
+}
+
+
+BasicSampleLoader::BasicSampleLoader()
+{
+}
+
+BasicSampleLoader::~BasicSampleLoader()
+{
+}
+
+
+void BasicSampleLoader::load(
+	const std::string &imageFileName,
+	cv::Mat &image,
+	ObjectDetection &annot )
+{
+	// load the annotations
+	loadAnnotations(imageFileName, annot);
+
+	// load the image (reduced according to the face size)
+	double scale = readImage(imageFileName, annot, image);
+	if (scale != 1)
+	{
+		annot /= (float) (1.0 / scale);
+		annot.computeBoundingBox(0.1);
+	}
+}
+
+
+bool BasicSampleLoader::isThreadSafe() const
+{
+	return true;
+}
+
 SampleList::SampleList(
 	const std::string &fileName,
-	SampleLoader *loader )
+	SampleLoader *loader ) : arenaUsed(0), cacheData(NULL), cacheSize(0)
 {
-	char line[256];
+	if (isCache(fileName))
+	{
+		loadCache(fileName);
+		return;
+	}
+
+	std::string line;
 	int imageCount = 0, i = 0;
 	BasicSampleLoader defaultLoader;
 
@@ -55,49 +204,296 @@ SampleList::SampleList(
 	// open script file
 	std::ifstream list(fileName.c_str());
 	// read the amount of files
-	list.getline(line, sizeof(line));
-	if (sscanf(line, "%d", &imageCount) != 1)
+	std::getline(list, line);
+	if (sscanf(line.c_str(), "%d", &imageCount) != 1)
 		throw 1;
 
-	images.resize(imageCount);
-	annotations.resize(imageCount);
 	imageFileNames.resize(imageCount);
-
+	std::vector<std::pair<uint64_t, int> > order(imageCount);
 	for (int j = 0; j < imageCount; ++j)
 	{
-		list.getline(line, sizeof(line) - 5);
-
-		//std::cout << "Loading " << i << " of " << imageCount << ": " << line << std::endl;
-
+		uint64_t fileSize;
+		int width, height;
+		std::getline(list, line);
+		parseScriptLine(line, imageFileNames[j], fileSize, width, height);
+		order[j] = std::make_pair((uint64_t) width * height, -j);
+	}
+	// the largest images (if known) are decoded first, so they do not end up
+	// alone at the end of the parallel loop
+	std::sort(order.rbegin(), order.rend());
+
+	// Decoding the images is the expensive part, so thread-safe loaders run in
+	// parallel. Each file has its own slot to keep the original order.
+	std::vector<cv::Mat> loaded(imageCount);
+	std::vector<ObjectDetection> loadedObjects(imageCount);
+	std::vector<char> valid(imageCount, 0);
+	#pragma omp parallel for schedule(dynamic) if (loader->isThreadSafe())
+	for (int k = 0; k < imageCount; ++k)
+	{
+		const int j = -order[k].second;
 		try
 		{
 			// call the loader to load the image and annotations
-			cv::Mat *image = new cv::Mat();
-			ObjectDetection *annot = new ObjectDetection();
-			loader->load(line, *image, *annot);
-			// fill the internal lists
-			imageFileNames[i] = line;
-			images[i] = image;
-			std::vector<ObjectDetection*> temp;
-			temp.push_back(annot);
-			annotations[i] = temp;
-			++i;
+			loader->load(imageFileNames[j], loaded[j], loadedObjects[j]);
+			valid[j] = 1;
 		} catch (...)
 		{
 			// suppress errors
+			loaded[j].release();
 		}
 	}
 
-	images.resize(i);
-	annotations.resize(i);
+	// remove the samples that failed to load
+	for (int j = 0; j < imageCount; ++j)
+	{
+		if (!valid[j]) continue;
+		cv::swap(loaded[i], loaded[j]);
+		std::swap(loadedObjects[i], loadedObjects[j]);
+		imageFileNames[i].swap(imageFileNames[j]);
+		++i;
+	}
+	loaded.resize(i);
+	loadedObjects.resize(i);
 	imageFileNames.resize(i);
+
+	// move the pixels to the arenas (releasing the decoded images as we go)
+	imageData.resize(i);
+	for (int j = 0; j < i; ++j)
+	{
+		imageData[j] = allocateImage(loaded[j].rows, loaded[j].cols, loaded[j].type());
+		loaded[j].copyTo(imageData[j]);
+		loaded[j].release();
+	}
+	setObjects(loadedObjects);
 	std::cout << images.size() << std::endl;
 }
 
 
 SampleList::~SampleList()
 {
-	// TODO: free memory here
+	// the views must go before the memory they point to
+	images.clear();
+	annotations.clear();
+	imageData.clear();
+	objects.clear();
+	arenas.clear();
+#if defined(__unix__) || defined(__APPLE__)
+	if (cacheData != NULL)
+		munmap(cacheData, cacheSize);
+#endif
+}
+
+
+void SampleList::parseScriptLine(
+	const std::string &line,
+	std::string &imageFileName,
+	uint64_t &fileSize,
+	int &width,
+	int &height )
+{
+	fileSize = 0;
+	width = height = 0;
+
+	size_t pos = line.find('\t');
+	imageFileName = line.substr(0, pos);
+	if (pos != std::string::npos)
+	{
+		unsigned long long size = 0;
+		if (sscanf(line.c_str() + pos + 1, "%llu %d %d", &size, &width, &height) != 3)
+			width = height = 0;
+		fileSize = size;
+	}
+}
+
+
+bool SampleList::isCache(
+	const std::string &fileName )
+{
+	char magic[sizeof(CACHE_MAGIC)];
+	std::ifstream input(fileName.c_str(), std::ios::binary);
+	return input.read(magic, sizeof(magic)) &&
+		std::memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0;
+}
+
+
+void SampleList::save(
+	const std::string &fileName ) const
+{
+	std::ofstream output(fileName.c_str(), std::ios::binary);
+	if (!output.good())
+		throw std::runtime_error("Unable to create the cache file " + fileName);
+
+	CacheHeader header;
+	std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.count = (uint32_t) images.size();
+
+	// compute the index
+	std::vector<CacheEntry> index(images.size());
+	std::vector<cv::Mat> pixels(images.size());
+	uint64_t offset = cacheAlign(sizeof(header) + index.size() * sizeof(CacheEntry));
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		const ObjectDetection &annot = *annotations[i][0];
+		pixels[i] = (images[i]->isContinuous()) ? *images[i] : images[i]->clone();
+
+		CacheEntry &entry = index[i];
+		entry.rows = pixels[i].rows;
+		entry.cols = pixels[i].cols;
+		entry.type = pixels[i].type();
+		entry.parts = (int32_t) annot.num_parts();
+		entry.nameLength = (int32_t) imageFileNames[i].length();
+		entry.rect[0] = annot.get_rect().x;
+		entry.rect[1] = annot.get_rect().y;
+		entry.rect[2] = annot.get_rect().width;
+		entry.rect[3] = annot.get_rect().height;
+		entry.offset = offset;
+
+		offset = cacheAlign(offset + entry.nameLength);
+		offset = cacheAlign(offset + entry.parts * 2 * sizeof(float));
+		offset = cacheAlign(offset + pixels[i].total() * pixels[i].elemSize());
+	}
+
+	output.write((const char*) &header, sizeof(header));
+	if (!index.empty())
+		output.write((const char*) &index[0], index.size() * sizeof(CacheEntry));
+
+	uint64_t position = sizeof(header) + index.size() * sizeof(CacheEntry);
+	for (size_t i = 0; i < images.size(); ++i)
+	{
+		const ObjectDetection &annot = *annotations[i][0];
+		const CacheEntry &entry = index[i];
+		std::vector<float> parts(entry.parts * 2);
+		for (int32_t j = 0; j < entry.parts; ++j)
+		{
+			parts[j * 2] = annot.part(j).x;
+			parts[j * 2 + 1] = annot.part(j).y;
+		}
+
+		cacheWrite(output, position, entry.offset, imageFileNames[i].c_str(), entry.nameLength);
+		cacheWrite(output, position, cacheAlign(position), (parts.empty()) ? NULL : &parts[0],
+			parts.size() * sizeof(float));
+		cacheWrite(output, position, cacheAlign(position), pixels[i].data,
+			pixels[i].total() * pixels[i].elemSize());
+	}
+	cacheWrite(output, position, cacheAlign(position), NULL, 0);
+
+	if (!output.good())
+		throw std::runtime_error("Unable to write the cache file " + fileName);
+}
+
+
+void SampleList::loadCache(
+	const std::string &fileName )
+{
+#if defined(__unix__) || defined(__APPLE__)
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Unable to open the cache file " + fileName);
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("Unable to open the cache file " + fileName);
+	}
+	// private mapping: the pixels are only read from the file, and writes to
+	// the images (if any) do not reach it
+	cacheSize = info.st_size;
+	cacheData = mmap(NULL, cacheSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cacheData == MAP_FAILED)
+	{
+		cacheData = NULL;
+		throw std::runtime_error("Unable to map the cache file " + fileName);
+	}
+#else
+	throw std::runtime_error("Cache files are not supported in this platform");
+#endif
+
+	uint8_t *data = (uint8_t*) cacheData;
+	const CacheHeader &header = *(const CacheHeader*) data;
+	if (cacheSize < sizeof(header) || std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+		header.version != CACHE_VERSION ||
+		!cacheFits(sizeof(header), (uint64_t) header.count * sizeof(CacheEntry), cacheSize))
+		throw std::runtime_error("Invalid cache file " + fileName);
+	const CacheEntry *index = (const CacheEntry*) (data + sizeof(header));
+
+	imageData.resize(header.count);
+	imageFileNames.resize(header.count);
+	std::vector<ObjectDetection> cached(header.count);
+	for (uint32_t i = 0; i < header.count; ++i)
+	{
+		// Every field is checked before it is used. The sizes are computed
+		// with 64 bits from non-negative 32 bit values, and each block must
+		// fit in the rest of the file, so the offsets cannot wrap around.
+		const CacheEntry &entry = index[i];
+		if (entry.rows < 0 || entry.cols < 0 || entry.parts < 0 || entry.nameLength < 0 ||
+			entry.type < 0 || entry.type != CV_MAT_TYPE(entry.type))
+			throw std::runtime_error("Invalid cache file " + fileName);
+
+		const uint64_t offset = entry.offset;
+		if (!cacheFits(offset, (uint64_t) entry.nameLength, cacheSize))
+			throw std::runtime_error("The cache file " + fileName + " is truncated");
+		const uint64_t partsOffset = cacheAlign(offset + entry.nameLength);
+		const uint64_t partsSize = (uint64_t) entry.parts * 2 * sizeof(float);
+		if (!cacheFits(partsOffset, partsSize, cacheSize))
+			throw std::runtime_error("The cache file " + fileName + " is truncated");
+		const uint64_t pixelsOffset = cacheAlign(partsOffset + partsSize);
+		const uint64_t pixelCount = (uint64_t) entry.rows * entry.cols;
+		const uint64_t elementSize = CV_ELEM_SIZE(entry.type);
+		if (pixelsOffset > cacheSize || pixelCount > (cacheSize - pixelsOffset) / elementSize)
+			throw std::runtime_error("The cache file " + fileName + " is truncated");
+		cv::Mat image(entry.rows, entry.cols, entry.type, data + pixelsOffset);
+
+		imageFileNames[i].assign((const char*) data + offset, entry.nameLength);
+
+		const float *values = (const float*) (data + partsOffset);
+		std::vector<Point2f> parts(entry.parts);
+		for (int32_t j = 0; j < entry.parts; ++j)
+			parts[j] = Point2f(values[j * 2], values[j * 2 + 1]);
+
+		imageData[i] = image;
+		cached[i] = ObjectDetection(
+			Rect(entry.rect[0], entry.rect[1], entry.rect[2], entry.rect[3]), parts);
+	}
+	setObjects(cached);
+}
+
+
+cv::Mat SampleList::allocateImage(
+	int rows,
+	int cols,
+	int type )
+{
+	const size_t size = (size_t) rows * cols * CV_ELEM_SIZE(type);
+	if (size == 0)
+		return cv::Mat(rows, cols, type);
+
+	// images larger than the arena size get their own arena
+	if (arenas.empty() || arenaUsed + size > (size_t) arenas.back().cols)
+	{
+		arenas.push_back(cv::Mat(1, (int) std::max(size, (size_t) ARENA_SIZE), CV_8U));
+		arenaUsed = 0;
+	}
+	cv::Mat image(rows, cols, type, arenas.back().data + arenaUsed);
+	arenaUsed = (arenaUsed + size + 15) & ~((size_t) 15);
+	return image;
+}
+
+
+void SampleList::setObjects(
+	std::vector<ObjectDetection> &loadedObjects )
+{
+	objects.swap(loadedObjects);
+
+	// the pointer lists used by the trainer
+	images.resize(imageData.size());
+	annotations.resize(objects.size());
+	for (size_t i = 0; i < imageData.size(); ++i)
+	{
+		images[i] = &imageData[i];
+		annotations[i].assign(1, &objects[i]);
+	}
 }
 
 
@@ -0,0 +1,78 @@
+#include "SampleStorage.hh"
+#include <stdexcept>
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+
+namespace ert {
+
+
+SampleStorage::SampleStorage(
+	const std::string &directory,
+	bool shared ) : directory(directory), shared(shared)
+{
+}
+
+
+SampleStorage::~SampleStorage()
+{
+	blocks.clear();
+#if defined(__unix__) || defined(__APPLE__)
+	for (size_t i = 0; i < mappings.size(); ++i)
+		munmap(mappings[i].first, mappings[i].second);
+#endif
+}
+
+
+cv::Mat SampleStorage::allocate(
+	int rows,
+	int cols,
+	int type )
+{
+	if ((directory.empty() && !shared) || rows == 0 || cols == 0)
+	{
+		blocks.push_back(cv::Mat::zeros(rows, cols, type));
+		return blocks.back();
+	}
+
+#if defined(__unix__) || defined(__APPLE__)
+	const size_t size = (size_t) rows * cols * CV_ELEM_SIZE(type);
+
+	if (directory.empty())
+	{
+		void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (data == MAP_FAILED)
+			throw std::runtime_error("Unable to allocate shared memory for the samples");
+		mappings.push_back(std::make_pair(data, size));
+		return cv::Mat(rows, cols, type, data);
+	}
+
+	std::string fileName = directory + "/ert-spill-XXXXXX";
+	std::vector<char> name(fileName.begin(), fileName.end());
+	name.push_back(0);
+	int fd = mkstemp(&name[0]);
+	if (fd < 0)
+		throw std::runtime_error("Unable to create a spill file in " + directory);
+	// the file is released when the mapping is removed
+	unlink(&name[0]);
+
+	void *data = MAP_FAILED;
+	if (ftruncate(fd, (off_t) size) == 0)
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		throw std::runtime_error("Unable to map a spill file in " + directory);
+
+	mappings.push_back(std::make_pair(data, size));
+	return cv::Mat(rows, cols, type, data);
+#else
+	throw std::runtime_error("Spill files are not supported in this platform");
+#endif
+}
+
+
+}
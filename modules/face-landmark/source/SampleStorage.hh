@@ -0,0 +1,60 @@
+#ifndef FA_LANDMARK_ERT_SAMPLE_STORAGE_HH
+#define FA_LANDMARK_ERT_SAMPLE_STORAGE_HH
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+namespace ert
+{
+
+
+/**
+ * Allocates the large per-sample buffers of the trainer (feature pixel values
+ * and current shapes).
+ *
+ *     SampleStorage storage("/scratch");
+ *     cv::Mat features = storage.allocate(samples, pool_size, CV_8U);
+ *
+ * Without a directory the buffers are regular matrices. Otherwise each buffer
+ * is a memory-mapped temporary file in that directory, so the operating system
+ * can move its pages to disk when the training data does not fit in memory.
+ * The files are removed right after they are created and the buffers are
+ * valid until the storage is destroyed.
+ *
+ * Shared storages allocate every buffer with 'mmap' (anonymous memory if there
+ * is no directory), so the buffers are shared with the processes created with
+ * 'fork' afterwards.
+ */
+class SampleStorage
+{
+	public:
+		explicit SampleStorage(
+			const std::string &directory,
+			bool shared = false );
+
+		~SampleStorage();
+
+		/**
+		 * Returns a zero-filled matrix.
+		 */
+		cv::Mat allocate(
+			int rows,
+			int cols,
+			int type );
+
+	private:
+		std::string directory;
+		bool shared;
+		std::vector<cv::Mat> blocks;
+		std::vector<std::pair<void*, size_t> > mappings;
+
+		SampleStorage( const SampleStorage & );
+
+		SampleStorage &operator=( const SampleStorage & );
+};
+
+
+}
+
+#endif // FA_LANDMARK_ERT_SAMPLE_STORAGE_HH
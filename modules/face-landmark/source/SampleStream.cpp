@@ -0,0 +1,158 @@
+#include <ert/SampleStream.hh>
+#include <cstdio>
+#include <stdexcept>
+
+
+namespace ert {
+
+
+SampleStream::SampleStream(
+	const std::string &fileName,
+	SampleLoader *loader,
+	size_t prefetch,
+	int threads ) : script(fileName.c_str()), loader(loader), count(0), nextLoad(0),
+		nextRead(0), slots(std::max(prefetch, (size_t) 1)), states(slots.size(), SLOT_EMPTY),
+		stopping(false)
+{
+	if (this->loader == NULL) this->loader = &defaultLoader;
+
+	// read the amount of files
+	std::string line;
+	int imageCount = 0;
+	if (!std::getline(script, line) || sscanf(line.c_str(), "%d", &imageCount) != 1)
+		throw std::runtime_error("Invalid script file " + fileName);
+	count = (size_t) std::max(imageCount, 0);
+
+	if (!this->loader->isThreadSafe() || threads < 1) threads = 1;
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&changed, NULL);
+	workers.reserve(threads);
+	for (int i = 0; i < threads; ++i)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, SampleStream::run, this) != 0)
+			break;
+		workers.push_back(thread);
+	}
+	if (workers.empty())
+	{
+		pthread_cond_destroy(&changed);
+		pthread_mutex_destroy(&mutex);
+		throw std::runtime_error("Unable to create the loading threads");
+	}
+}
+
+
+SampleStream::~SampleStream()
+{
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&changed);
+	pthread_mutex_unlock(&mutex);
+
+	for (size_t i = 0; i < workers.size(); ++i)
+		pthread_join(workers[i], NULL);
+
+	pthread_cond_destroy(&changed);
+	pthread_mutex_destroy(&mutex);
+}
+
+
+size_t SampleStream::size() const
+{
+	return count;
+}
+
+
+void *SampleStream::run(
+	void *stream )
+{
+	((SampleStream*) stream)->work();
+	return NULL;
+}
+
+
+void SampleStream::work()
+{
+	pthread_mutex_lock(&mutex);
+	while (true)
+	{
+		// wait for a free slot (i.e. the prefetch limit)
+		while (!stopping && nextLoad < count && nextLoad >= nextRead + slots.size())
+			pthread_cond_wait(&changed, &mutex);
+		if (stopping || nextLoad >= count) break;
+
+		// the script is read as the samples are claimed
+		const size_t index = nextLoad++;
+		Sample &slot = slots[index % slots.size()];
+		states[index % slots.size()] = SLOT_LOADING;
+		slot.index = index;
+		std::string line;
+		uint64_t fileSize;
+		int width, height;
+		if (std::getline(script, line))
+			SampleList::parseScriptLine(line, slot.imageFileName, fileSize, width, height);
+		else
+			slot.imageFileName.clear();
+		pthread_mutex_unlock(&mutex);
+
+		// the slot belongs to this thread until it is marked as ready
+		bool loaded = false;
+		if (!slot.imageFileName.empty())
+		{
+			try
+			{
+				slot.annot = ObjectDetection();
+				loader->load(slot.imageFileName, slot.image, slot.annot);
+				loaded = true;
+			} catch (...)
+			{
+				// suppress errors
+			}
+		}
+
+		pthread_mutex_lock(&mutex);
+		states[index % slots.size()] = (loaded) ? SLOT_READY : SLOT_FAILED;
+		pthread_cond_broadcast(&changed);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+
+bool SampleStream::next(
+	Sample &sample )
+{
+	pthread_mutex_lock(&mutex);
+	while (nextRead < count)
+	{
+		const size_t slot = nextRead % slots.size();
+		while (states[slot] == SLOT_EMPTY || states[slot] == SLOT_LOADING)
+			pthread_cond_wait(&changed, &mutex);
+
+		// the loaded sample is moved out, so its memory goes with it
+		const bool ready = (states[slot] == SLOT_READY);
+		if (ready)
+		{
+			sample.index = slots[slot].index;
+			sample.imageFileName.swap(slots[slot].imageFileName);
+			cv::swap(sample.image, slots[slot].image);
+			std::swap(sample.annot, slots[slot].annot);
+		}
+		slots[slot].image.release();
+		states[slot] = SLOT_EMPTY;
+		++nextRead;
+		pthread_cond_broadcast(&changed);
+
+		if (ready)
+		{
+			pthread_mutex_unlock(&mutex);
+			return true;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return false;
+}
+
+
+} // namespace ert
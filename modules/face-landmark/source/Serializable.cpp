@@ -1,4 +1,6 @@
 #include <ert/Serializable.hh>
+#include <climits>
+#include <stdexcept>
 
 
 namespace ert {
@@ -170,16 +172,25 @@ std::istream &Serializable::deserialize( std::istream &in, uint64_t& value )
 std::istream &Serializable::deserialize( std::istream &in, cv::Mat& value )
 {
 	uint32_t rows, cols, type, elementSize;
-	char *data = NULL;
 
 	deserialize(in, rows);
 	deserialize(in, cols);
 	deserialize(in, type);
 	deserialize(in, elementSize);
-	data = new char[rows * cols * elementSize];
-	in.read( data, rows * cols * elementSize );
-
-	value = cv::Mat(rows, cols, type, data);
+	// the header comes from a file, so it is checked before anything is allocated
+	if (!in.good())
+		throw std::runtime_error("Unexpected end of file while reading a matrix");
+	if (rows > (uint32_t) INT_MAX || cols > (uint32_t) INT_MAX ||
+		type != (uint32_t) CV_MAT_TYPE(type) || CV_ELEM_SIZE(type) != elementSize)
+		throw std::runtime_error("Invalid matrix header");
+
+	// let the matrix own the data, so it is released with the matrix
+	value.create((int) rows, (int) cols, (int) type);
+	const size_t size = value.total() * value.elemSize();
+	if (size > 0)
+		in.read( (char*) value.data, size );
+	if (in.fail())
+		throw std::runtime_error("Unexpected end of file while reading a matrix");
 
 	return in;
 }
@@ -2,6 +2,14 @@
 #include "PointAffineTransform.hh"
 #include "ProgressIndicator.hh"
 #include <ert/Serializable.hh>
+#include <ert/SampleStream.hh>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "rand/rand_kernel_1.h"
 
 
@@ -89,81 +97,181 @@ std::ostream& operator<<(std::ostream& os, const ObjectDetection& obj)
         const std::vector<std::vector<double> >& scales
     )
     {
-        // make sure requires clause is not broken
-#ifdef ENABLE_ASSERTS
-        /*DLIB_CASSERT( images.size() == objects.size() ,
-            "\t double test_shape_predictor()"
-            << "\n\t Invalid inputs were given to this function. "
-            << "\n\t images.size():  " << images.size()
-            << "\n\t objects.size(): " << objects.size()
-        );*/
+        return evaluate_shape_predictor(sp, images, objects, scales).mean_error;
+    }
+
+
+    static double percentile(
+        const std::vector<double> &sorted,
+        double fraction )
+    {
+        if (sorted.empty()) return 0;
+        size_t index = (size_t) std::ceil(fraction * sorted.size());
+        if (index > 0) --index;
+        return sorted[std::min(index, sorted.size() - 1)];
+    }
+
+
+    ShapePredictorEvaluation evaluate_shape_predictor (
+        const ShapePredictor& sp,
+        const std::vector<Mat*>& images,
+        const std::vector<std::vector<ObjectDetection*> >& objects,
+        const std::vector<std::vector<double> >& scales,
+        int threads
+    )
+    {
+        // every object is evaluated on its own
+        std::vector<std::pair<unsigned long, unsigned long> > faces;
         for (unsigned long i = 0; i < objects.size(); ++i)
-        {
             for (unsigned long j = 0; j < objects[i].size(); ++j)
+                faces.push_back(std::make_pair(i, j));
+        const unsigned long num_parts = (faces.empty()) ? 0 : objects[faces[0].first][faces[0].second]->num_parts();
+
+#ifdef _OPENMP
+        if (threads <= 0) threads = omp_get_max_threads();
+#else
+        threads = 1;
+#endif
+
+        // the errors of each face are kept apart and added in face order
+        // afterwards, so the results do not depend on the threads
+        std::vector<double> errors(faces.size() * num_parts, 0.0);
+        std::vector<char> measured(faces.size(), 0);
+        std::vector<double> latencies(faces.size());
+        const int64 start = cv::getTickCount();
+        #pragma omp parallel for schedule(dynamic, 8) num_threads(threads)
+        for (long f = 0; f < (long) faces.size(); ++f)
+        {
+            const unsigned long i = faces[f].first;
+            const unsigned long j = faces[f].second;
+            // Just use a scale of 1 (i.e. no scale at all) if the caller didn't supply
+            // any scales.
+            const double scale = scales.size()==0 ? 1 : scales[i][j];
+
+            const int64 begin = cv::getTickCount();
+            ObjectDetection det = sp.detect(*images[i], objects[i][j]->get_rect());
+            latencies[f] = (double) (cv::getTickCount() - begin) * 1000.0 / cv::getTickFrequency();
+
+            // the faces without a scale (e.g. no eyes) are timed but have no error
+            if (!(scale > 0)) continue;
+            measured[f] = 1;
+            for (unsigned long k = 0; k < det.num_parts() && k < num_parts; ++k)
             {
-                /*DLIB_CASSERT(objects[i][j].num_parts() == sp.num_parts(),
-                    "\t double test_shape_predictor()"
-                    << "\n\t Invalid inputs were given to this function. "
-                    << "\n\t objects["<<i<<"]["<<j<<"].num_parts(): " << objects[i][j].num_parts()
-                    << "\n\t sp.num_parts(): " << sp.num_parts()
-                );*/
+                Point2f gold, fit;
+                fit.x = round( det.part(k).x );
+                fit.y = round( det.part(k).y );
+                gold.x = round(objects[i][j]->part(k).x);
+                gold.y = round(objects[i][j]->part(k).y);
+                errors[f * num_parts + k] = mylength(fit - gold)/scale;
             }
-            if (scales.size() != 0)
+        }
+        const double elapsed = (double) (cv::getTickCount() - start) / cv::getTickFrequency();
+
+        ShapePredictorEvaluation result;
+        result.faces = faces.size();
+        result.threads = threads;
+        result.part_errors.assign(num_parts, 0.0);
+        double total = 0, total_latency = 0;
+        size_t measured_faces = 0;
+        for (size_t f = 0; f < faces.size(); ++f)
+        {
+            total_latency += latencies[f];
+            if (!measured[f]) continue;
+            for (unsigned long k = 0; k < num_parts; ++k)
             {
-                /*DLIB_CASSERT(objects[i].size() == scales[i].size(),
-                    "\t double test_shape_predictor()"
-                    << "\n\t Invalid inputs were given to this function. "
-                    << "\n\t objects["<<i<<"].size(): " << objects[i].size()
-                    << "\n\t scales["<<i<<"].size(): " << scales[i].size()
-                );*/
-
+                result.part_errors[k] += errors[f * num_parts + k];
+                total += errors[f * num_parts + k];
             }
+            ++measured_faces;
         }
-#endif
+        // without any error the means are undefined (see write_json)
+        const double undefined = std::numeric_limits<double>::quiet_NaN();
+        for (unsigned long k = 0; k < num_parts; ++k)
+            result.part_errors[k] = (measured_faces > 0) ? result.part_errors[k] / measured_faces : undefined;
+        result.mean_error = (measured_faces > 0 && num_parts > 0) ? total / (measured_faces * num_parts) : undefined;
+
+        std::sort(latencies.begin(), latencies.end());
+        result.mean_latency = (faces.empty()) ? 0 : total_latency / faces.size();
+        result.latency_p50 = percentile(latencies, 0.50);
+        result.latency_p95 = percentile(latencies, 0.95);
+        result.latency_p99 = percentile(latencies, 0.99);
+        result.throughput = (elapsed > 0) ? faces.size() / elapsed : 0;
+        return result;
+    }
 
-        //running_stats<double> rs;
+
+    /**
+     * Write a JSON number, or null if the value is not finite (JSON has no
+     * NaN or infinity).
+     */
+    static void write_json_number(
+        std::ostream &out,
+        double value )
+    {
+        // the difference is NaN for NaN and infinities
+        if (value - value == 0)
+            out << value;
+        else
+            out << "null";
+    }
+
+
+    void ShapePredictorEvaluation::write_json(
+        std::ostream &out ) const
+    {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision(9);
+        out << "{\"faces\":" << faces << ",\"threads\":" << threads << ",\"mean_error\":";
+        write_json_number(out, mean_error);
+        out << ",\"part_errors\":[";
+        for (size_t k = 0; k < part_errors.size(); ++k)
+        {
+            out << ((k == 0) ? "" : ",");
+            write_json_number(out, part_errors[k]);
+        }
+        out << "],\"latency_ms\":{\"mean\":";
+        write_json_number(out, mean_latency);
+        out << ",\"p50\":";
+        write_json_number(out, latency_p50);
+        out << ",\"p95\":";
+        write_json_number(out, latency_p95);
+        out << ",\"p99\":";
+        write_json_number(out, latency_p99);
+        out << "},\"faces_per_second\":";
+        write_json_number(out, throughput);
+        out << "}";
+        out.precision(precision);
+        out.flags(flags);
+    }
+
+
+    double test_shape_predictor (
+        const ShapePredictor& sp,
+        SampleStream &samples,
+        double (*scale)( const ObjectDetection& )
+    )
+    {
         double rs = 0;
         int count = 0;
-        for (unsigned long i = 0; i < objects.size(); ++i)
+        SampleStream::Sample sample;
+        while (samples.next(sample))
         {
-            for (unsigned long j = 0; j < objects[i].size(); ++j)
+            const double factor = (scale == NULL) ? 1 : scale(sample.annot);
+            // like above, the objects without a scale have no error
+            if (!(factor > 0)) continue;
+            ObjectDetection det = sp.detect(sample.image, sample.annot.get_rect());
+            for (unsigned long k = 0; k < det.num_parts(); ++k)
             {
-                // Just use a scale of 1 (i.e. no scale at all) if the caller didn't supply
-                // any scales.
-                const double scale = scales.size()==0 ? 1 : scales[i][j];
-                //const double scale = 1;
-
-                ObjectDetection det = sp.detect(*images[i], objects[i][j]->get_rect());
-/*std::cout << *objects[i][j] << std::endl;
-std::cout << det << std::endl;
-
-Mat output;
-cv::cvtColor(*images[i], output, CV_GRAY2BGR);
-plotFace(output, *objects[i][j], Scalar(255,0,0), 2);
-plotFace(output, det, Scalar(0,0,255));
-cv::imshow("Fit", output);
-
-char key = 0;
-do { key = cv::waitKey(0); } while (key != 'q');*/
-
-                for (unsigned long k = 0; k < det.num_parts(); ++k)
-                {
-					Point2f gold, fit;
-					fit.x = round( det.part(k).x );
-					fit.y = round( det.part(k).y );
-					gold.x = round(objects[i][j]->part(k).x);
-					gold.y = round(objects[i][j]->part(k).y);
-//					if (fit.x != gold.x || fit.y != gold.y)
-//std::cout << "Point[" << k << "] = (" << fit.x << ", " << fit.y << ")    Gold = (" << gold.x << ", " << gold.y << ")" << std::endl;
-                    double score = mylength(fit - gold)/scale;
-                    rs += score;
-                    ++count;
-                    //rs.add(score);
-                }
+                Point2f gold, fit;
+                fit.x = round( det.part(k).x );
+                fit.y = round( det.part(k).y );
+                gold.x = round(sample.annot.part(k).x);
+                gold.y = round(sample.annot.part(k).y);
+                rs += mylength(fit - gold)/factor;
+                ++count;
             }
         }
-        //return rs.mean();
-        return rs / count;
+        return (count > 0) ? rs / count : std::numeric_limits<double>::quiet_NaN();
     }
 
 
@@ -195,6 +303,21 @@ ShapePredictor::ShapePredictor (
 }
 
 
+std::vector<std::vector<Point2f> > ShapePredictor::get_pixel_coordinates (
+) const
+{
+	// invert the shape relative encoding computed in the constructor
+	std::vector<std::vector<Point2f> > pixel_coordinates(anchor_idx.size());
+	for (unsigned long i = 0; i < anchor_idx.size(); ++i)
+	{
+		pixel_coordinates[i].resize(anchor_idx[i].size());
+		for (unsigned long j = 0; j < anchor_idx[i].size(); ++j)
+			pixel_coordinates[i][j] = location(initial_shape, anchor_idx[i][j]) + deltas[i][j];
+	}
+	return pixel_coordinates;
+}
+
+
 ObjectDetection ShapePredictor::detect(
 	const Mat& img,
 	const Rect& rect,
@@ -1,12 +1,66 @@
 #include <ert/ShapePredictorTrainer.hh>
 #include <ert/opencv.hh>
 #include "PointAffineTransform.hh"
-#include "marsene_twister.h"
+#include "RandomStream.hh"
+#include "AliasTable.hh"
+#include "TrainingTelemetry.hh"
+#include "SampleStorage.hh"
+#include "ProcessGroup.hh"
 #include "ProgressIndicator.hh"
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <sstream>
+#include <climits>
+#include <cstdio>
+#include <ctime>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 namespace ert{
 
 
+	/**
+	 * Amount of samples each thread handles at once when looking for the best
+	 * split of a single node.
+	 */
+	static const unsigned long SPLIT_CHUNK_SIZE = 4096;
+
+
+	/**
+	 * Amount of possible differences between two 8-bit pixels (-255 to 255).
+	 */
+	static const int HISTOGRAM_BINS = 511;
+
+
+	/**
+	 * Size of the buffers holding the augmented crops. Larger crops get their
+	 * own buffer.
+	 */
+	static const size_t CROP_BLOCK_SIZE = 256 << 20;
+
+
+	/**
+	 * Identifies checkpoint files ("ERTC") and their format version.
+	 */
+	static const uint32_t CHECKPOINT_MAGIC = 0x43545245;
+	static const uint32_t CHECKPOINT_VERSION = 6;
+
+
+	/**
+	 * Returns the amount of threads available for parallel regions.
+	 */
+	static long get_max_threads()
+	{
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+
 	Point2f location (
 		const Mat& shape,
 		unsigned long idx
@@ -161,14 +215,15 @@ PointTransformAffine unnormalizing_tform (
 
 // ------------------------------------------------------------------------------------
 
-void extract_feature_pixel_values (
+template <typename T>
+static void extract_feature_pixel_values (
 	const Mat& img,
 	const Rect& rect,
 	const Mat& current_shape,
 	const Mat& reference_shape,
 	const std::vector<unsigned long>& reference_pixel_anchor_idx,
 	const std::vector<Point2f>& reference_pixel_deltas,
-	std::vector<double>& feature_pixel_values
+	T *feature_pixel_values
 )
 /*!
 	requires
@@ -196,8 +251,7 @@ void extract_feature_pixel_values (
 	const Rect area = Rect(0, 0, img.cols, img.rows);
 
 	//const_image_view<image_type> img(img_);
-	feature_pixel_values.resize(reference_pixel_deltas.size());
-	for (unsigned long i = 0; i < feature_pixel_values.size(); ++i)
+	for (unsigned long i = 0; i < reference_pixel_deltas.size(); ++i)
 	{
 		// Compute the Point in the current shape corresponding to the i-th pixel and
 		// then map it from the normalized shape space into pixel space.
@@ -206,7 +260,7 @@ void extract_feature_pixel_values (
 		p.y = round(p.y);
 		if (area.contains(p))
 		{
-			feature_pixel_values[i] = (double) img.at<uint8_t>(p.y, p.x);
+			feature_pixel_values[i] = (T) img.at<uint8_t>(p.y, p.x);
 //std::cout << "image(" << p.x << "," << p.y << ") = " << feature_pixel_values[i] << std::endl;
 //std::getchar();
 		}
@@ -217,6 +271,38 @@ void extract_feature_pixel_values (
 }
 
 
+void extract_feature_pixel_values (
+	const Mat& img,
+	const Rect& rect,
+	const Mat& current_shape,
+	const Mat& reference_shape,
+	const std::vector<unsigned long>& reference_pixel_anchor_idx,
+	const std::vector<Point2f>& reference_pixel_deltas,
+	std::vector<double>& feature_pixel_values
+)
+{
+	feature_pixel_values.resize(reference_pixel_deltas.size());
+	if (feature_pixel_values.empty()) return;
+	extract_feature_pixel_values(img, rect, current_shape, reference_shape, reference_pixel_anchor_idx,
+		reference_pixel_deltas, &feature_pixel_values[0]);
+}
+
+
+void extract_feature_pixel_values (
+	const Mat& img,
+	const Rect& rect,
+	const Mat& current_shape,
+	const Mat& reference_shape,
+	const std::vector<unsigned long>& reference_pixel_anchor_idx,
+	const std::vector<Point2f>& reference_pixel_deltas,
+	uint8_t *feature_pixel_values
+)
+{
+	extract_feature_pixel_values<uint8_t>(img, rect, current_shape, reference_shape, reference_pixel_anchor_idx,
+		reference_pixel_deltas, feature_pixel_values);
+}
+
+
 
 ShapePredictorTrainer::ShapePredictorTrainer ( )
 {
@@ -229,8 +315,25 @@ ShapePredictorTrainer::ShapePredictorTrainer ( )
 	_lambda = 0.1;
 	_num_test_splits = 20;
 	_feature_pool_region_padding = 0;
+	_split_strategy = SPLIT_RANDOM_THRESHOLD;
+	_tree_subsampling_fraction = 1;
+	_split_subsampling_size = 0;
+	_warm_start = NULL;
+	_augmentation_amount = 0;
+	_augmented = false;
+	_rotation_jitter = 0;
+	_scale_jitter = 0;
+	_telemetry_file = "";
+	_spill_directory = "";
+	_num_processes = 1;
+	_initial_state = NULL;
+	_validation_interval = 10;
+	_early_stopping_patience = 5;
+	_early_stopping_tolerance = 0.001;
+	_checkpoint_interval = 300;
+	_resume = false;
 	_verbose = false;
-	rnd = new Random();
+	_random_seed = "";
 }
 
 unsigned long ShapePredictorTrainer::get_cascade_depth (
@@ -299,7 +402,15 @@ void ShapePredictorTrainer::set_nu (
 
 
 std::string ShapePredictorTrainer::get_random_seed (
-) const { return rnd->get_seed(); }
+) const { return _random_seed; }
+
+
+void ShapePredictorTrainer::set_random_seed (
+	const std::string &seed
+)
+{
+	_random_seed = seed;
+}
 
 unsigned long ShapePredictorTrainer::get_oversampling_amount (
 ) const { return _oversampling_amount; }
@@ -325,12 +436,9 @@ void ShapePredictorTrainer::set_feature_pool_size (
 	unsigned long size
 )
 {
-	/*DLIB_CASSERT(size > 1,
-		"\t void shape_predictor_trainer::set_feature_pool_size()"
-		<< "\n\t Invalid inputs were given to this function. "
-		<< "\n\t size: " << size
-	);*/
-
+	// the split features are pairs of different pixels of the pool
+	if (size < 2)
+		throw std::runtime_error("The feature pool must have at least 2 pixels");
 	_feature_pool_size = size;
 }
 
@@ -378,306 +486,1861 @@ void ShapePredictorTrainer::set_feature_pool_region_padding (
 	_feature_pool_region_padding = padding;
 }
 
-void ShapePredictorTrainer::be_verbose (
-)
-{
-	_verbose = true;
-}
+ShapePredictorTrainer::SplitStrategy ShapePredictorTrainer::get_split_strategy (
+) const { return _split_strategy; }
 
-void ShapePredictorTrainer::be_quiet (
+
+void ShapePredictorTrainer::set_split_strategy (
+	SplitStrategy strategy
 )
 {
-	_verbose = false;
+	_split_strategy = strategy;
 }
 
+double ShapePredictorTrainer::get_tree_subsampling_fraction (
+) const { return _tree_subsampling_fraction; }
 
 
-ShapePredictor ShapePredictorTrainer::train (
-	const std::vector<Mat*>& images,
-	const std::vector<std::vector<ObjectDetection*> >& objects
-) const
+void ShapePredictorTrainer::set_tree_subsampling_fraction (
+	double fraction
+)
 {
-	assert(images.size() == objects.size() && images.size() > 0);
-	/*DLIB_CASSERT(images.size() == objects.size() && images.size() > 0,
-		"\t shape_predictor shape_predictor_trainer::train()"
-		<< "\n\t Invalid inputs were given to this function. "
-		<< "\n\t images.size():  " << images.size()
-		<< "\n\t objects.size(): " << objects.size()
-	);*/
+	assert(fraction > 0 && fraction <= 1);
+	_tree_subsampling_fraction = fraction;
+}
 
-	// make sure the objects agree on the number of parts and that there is at
-	// least one FullObjectDetection.
-	unsigned long num_parts = 0;
-	for (unsigned long i = 0; i < objects.size(); ++i)
-	{
-		for (unsigned long j = 0; j < objects[i].size(); ++j)
-		{
-			if (num_parts == 0)
-			{
-				num_parts = objects[i][j]->num_parts();
-				assert(objects[i][j]->num_parts() != 0);
-				/*DLIB_CASSERT(objects[i][j].num_parts() != 0,
-					"\t shape_predictor shape_predictor_trainer::train()"
-					<< "\n\t You can't give objects that don't have any parts to the trainer."
-				);*/
-			}
-			else
-			{
-				assert(objects[i][j]->num_parts() == num_parts);
-				/*DLIB_CASSERT(objects[i][j].num_parts() == num_parts,
-					"\t shape_predictor shape_predictor_trainer::train()"
-					<< "\n\t All the objects must agree on the number of parts. "
-					<< "\n\t objects["<<i<<"]["<<j<<"].num_parts(): " << objects[i][j].num_parts()
-					<< "\n\t num_parts:  " << num_parts
-				);*/
-			}
-		}
-	}
-	/*DLIB_CASSERT(num_parts != 0,
-		"\t shape_predictor shape_predictor_trainer::train()"
-		<< "\n\t You must give at least one full_object_detection if you want to train a shape model and it must have parts."
-	);*/
 
-	//rnd.set_seed(get_random_seed());
-	rnd->set_seed("HELLO");
+unsigned long ShapePredictorTrainer::get_split_subsampling_size (
+) const { return _split_subsampling_size; }
 
-	std::vector<TrainingSample> samples;
 
-	// compute the initial shape guests for each training sample
-	const Mat initial_shape = populate_training_sample_shapes(objects, samples);
+void ShapePredictorTrainer::set_split_subsampling_size (
+	unsigned long size
+)
+{
+	_split_subsampling_size = size;
+}
 
-	const std::vector<std::vector<Point2f > > pixel_coordinates = randomly_sample_pixel_coordinates(initial_shape);
 
+const InitialTrainingState *ShapePredictorTrainer::get_initial_state (
+) const { return _initial_state; }
 
-	unsigned long trees_fit_so_far = 0;
-	ProgressIndicator pbar(get_cascade_depth()*get_num_trees_per_cascade_level());
-	if (_verbose)
-		std::cout << "Fitting trees..." << std::endl;
 
-//for (int i = 0; i < 68; ++i)
-//std::cout << "part[" << i << "] = " << objects[0][0]->part(i) << std::endl;
+void ShapePredictorTrainer::set_initial_state (
+	const InitialTrainingState *state
+)
+{
+	_initial_state = state;
+}
 
-	std::vector<std::vector<RegressionTree> > forests(get_cascade_depth());
 
-	// Now start doing the actual training by filling in the forests
-	for (unsigned long cascade = 0; cascade < get_cascade_depth(); ++cascade)
-	{
-//std::cout << "initial_shape = " << std::endl << initial_shape << std::endl << std::endl;
-		// Each cascade uses a different set of pixels for its features.  We compute
-		// their representations relative to the initial shape first.
-		std::vector<unsigned long> anchor_idx;
-		std::vector<Point2f > deltas;
-		create_shape_relative_encoding(initial_shape, pixel_coordinates[cascade], anchor_idx, deltas);
+unsigned long ShapePredictorTrainer::get_num_processes (
+) const { return _num_processes; }
 
 
-/*for (int i = 0; i < pixel_coordinates[cascade].size(); ++i)
-std::cout << "pixel_coordinates[" << i << "] = " << pixel_coordinates[cascade][i] << std::endl;
+void ShapePredictorTrainer::set_num_processes (
+	unsigned long processes
+)
+{
+	assert(processes > 0);
+	_num_processes = processes;
+}
+
 
-std::getchar();*/
+const std::string &ShapePredictorTrainer::get_spill_directory (
+) const { return _spill_directory; }
 
 
-		// First compute the feature_pixel_values for each training sample at this
-		// level of the cascade.
-		for (unsigned long i = 0; i < samples.size(); ++i)
-		{
-			extract_feature_pixel_values(*images[samples[i].image_idx], samples[i].rect,
-				samples[i].current_shape, initial_shape, anchor_idx,
-				deltas, samples[i].feature_pixel_values);
-		}
+void ShapePredictorTrainer::set_spill_directory (
+	const std::string &directory
+)
+{
+	_spill_directory = directory;
+}
 
-		// Now start building the trees at this cascade level.
-		forests[cascade].reserve( get_num_trees_per_cascade_level() );
-		for (unsigned long i = 0; i < get_num_trees_per_cascade_level(); ++i)
-		{
-			forests[cascade].push_back(make_regression_tree(samples, pixel_coordinates[cascade]));
 
-			if (_verbose)
-			{
-				++trees_fit_so_far;
-				pbar.update(trees_fit_so_far, true);
-			}
-		}
-	}
+unsigned long ShapePredictorTrainer::get_augmentation_amount (
+) const { return _augmentation_amount; }
 
-	if (_verbose)
-		std::cout << "Training complete                          " << std::endl;
 
-	return ShapePredictor(initial_shape, forests, pixel_coordinates);
+void ShapePredictorTrainer::set_augmentation_amount (
+	unsigned long amount
+)
+{
+	_augmentation_amount = amount;
 }
 
 
+const std::vector<unsigned long> &ShapePredictorTrainer::get_mirror_map (
+) const { return _mirror_map; }
 
-// CHECKED!!!
-cv::Mat ShapePredictorTrainer::object_to_shape (
-	const ObjectDetection& obj )
-{
-	// create an matrix of 2xN, where N is the amount of parts
-	cv::Mat shape(2, obj.num_parts(), CV_64F);
-//std::cout << "ready for tform_from_img " << obj.get_rect() << std::endl;
-	const PointTransformAffine tform_from_img = normalizing_tform(obj.get_rect());
-//std::cout << "tform_from_img = " << tform_from_img.get_b() << std::endl;
 
-	for (unsigned long i = 0; i < obj.num_parts(); ++i)
+void ShapePredictorTrainer::set_mirror_map (
+	const std::vector<unsigned long> &map
+)
+{
+	for (size_t i = 0; i < map.size(); ++i)
 	{
-//std::cout << "original_point[" << i << "] = " << obj.part(i) << std::endl;
-		cv::Point2f p = tform_from_img(obj.part(i));
-//std::cout << "target_point[" << i << "] = " << p << std::endl;
-		shape.at<double>(0, i) = p.x;
-		shape.at<double>(1, i) = p.y;
+		if (map[i] >= map.size() || map[map[i]] != i)
+			throw std::runtime_error("The mirror map must pair the parts");
 	}
-	return shape;
+	_mirror_map = map;
 }
 
 
-void ShapePredictorTrainer::printShape( const std::string& prefix, const cv::Mat& mat ) const
+double ShapePredictorTrainer::get_rotation_jitter (
+) const { return _rotation_jitter; }
+
+
+void ShapePredictorTrainer::set_rotation_jitter (
+	double degrees
+)
 {
-	std::cout << prefix;
-	for (int i = 0; i < mat.cols; ++i)
-		for (int j = 0; j < mat.rows; ++j)
-			std::cout << mat.at<double>(j,i) << std::endl;
-	std::cout << std::endl;
+	_rotation_jitter = std::fabs(degrees);
 }
 
 
-RegressionTree ShapePredictorTrainer::make_regression_tree (
-	std::vector<TrainingSample>& samples,
-	const std::vector<cv::Point2f >& pixel_coordinates
-) const
+double ShapePredictorTrainer::get_scale_jitter (
+) const { return _scale_jitter; }
+
+
+void ShapePredictorTrainer::set_scale_jitter (
+	double fraction
+)
 {
-	std::deque<std::pair<unsigned long, unsigned long> > parts;
-	parts.push_back(std::make_pair(0, (unsigned long)samples.size()));
+	if (fraction < 0 || fraction >= 1)
+		throw std::runtime_error("The scale jitter must be in the range [0, 1)");
+	_scale_jitter = fraction;
+}
 
-	RegressionTree tree;
 
-	// walk the tree in breadth first order
-	const unsigned long num_split_nodes = static_cast<unsigned long>(std::pow(2.0, (double)get_tree_depth())-1);
+const std::string &ShapePredictorTrainer::get_telemetry_file (
+) const { return _telemetry_file; }
 
-	std::vector<cv::Mat > sums(num_split_nodes*2+1);
-	for (unsigned long i = 0; i < sums.size(); ++i)
-		sums[i] = cv::Mat::zeros(samples[0].current_shape.rows, samples[0].current_shape.cols, samples[0].current_shape.type());
 
-	for (unsigned long i = 0; i < samples.size(); ++i)
-	{
-		sums[0] += samples[i].target_shape - samples[i].current_shape;
-//std::cout << "samples[" << i << "].current_shape";
-//printShape(" = ", samples[i].current_shape);
-	}
-//printShape("sums[0] = ", sums[0]);
-	for (unsigned long i = 0; i < num_split_nodes; ++i)
-	{
-		std::pair<unsigned long,unsigned long> range = parts.front();
-		parts.pop_front();
+void ShapePredictorTrainer::set_telemetry_file (
+	const std::string &fileName
+)
+{
+	_telemetry_file = fileName;
+}
 
-		const SplitFeature split = generate_split(samples, range.first,
-			range.second, pixel_coordinates, sums[i], sums[left_child(i)],
-			sums[right_child(i)]);
-		tree.splits.push_back(split);
-//std::cout << "Split #" << i << " = " << split.thresh << " " << split.idx1 << " " << split.idx2  << std::endl;
-		const unsigned long mid = partition_samples(split, samples, range.first, range.second);
 
-		parts.push_back(std::make_pair(range.first, mid));
-		parts.push_back(std::make_pair(mid, range.second));
-	}
+const ShapePredictor *ShapePredictorTrainer::get_warm_start (
+) const { return _warm_start; }
 
-	// Now all the parts contain the ranges for the leaves so we can use them to
-	// compute the average leaf values.
-	tree.leaf_values.resize(parts.size());
-	for (unsigned long i = 0; i < parts.size(); ++i)
-	{
-		if (parts[i].second != parts[i].first)
-		{
-//std::cout << parts[i].second << " != " <<  parts[i].first << std::endl;
-			tree.leaf_values[i] = sums[num_split_nodes+i]*get_nu()/(parts[i].second - parts[i].first);
-/*std::cout << "tree.leaf_values[" << i << "]";
-printShape(" = ", tree.leaf_values[i]);*/
-		}
-		else
-			tree.leaf_values[i] = cv::Mat::zeros(samples[0].target_shape.rows, samples[0].target_shape.cols, CV_64F);//zeros_matrix(samples[0].target_shape);
 
-		// now adjust the current shape based on these predictions
-		for (unsigned long j = parts[i].first; j < parts[i].second; ++j)
-			samples[j].current_shape += tree.leaf_values[i];
-	}
-//std::cout << "newer samples[" << 0 << "].current_shape = " << samples[0].current_shape << std::endl;
-//std::getchar();
-	return tree;
+void ShapePredictorTrainer::set_warm_start (
+	const ShapePredictor *model
+)
+{
+	_warm_start = model;
 }
 
-/**
- * Create an split feature with randomly generated threshold.
- */
-SplitFeature ShapePredictorTrainer::randomly_generate_split_feature (
-	const std::vector<cv::Point2f >& pixel_coordinates
-) const
-{
-	const double lambda = get_lambda();
-	SplitFeature feat;
-	double accept_prob;
-	do
-	{
-		feat.idx1   = rnd->get_random_32bit_number() % get_feature_pool_size();
-		feat.idx2   = rnd->get_random_32bit_number() % get_feature_pool_size();
-		const double dist = length(pixel_coordinates[feat.idx1]-pixel_coordinates[feat.idx2]);
-		accept_prob = std::exp(-dist/lambda);
-	}
-	while(feat.idx1 == feat.idx2 || !(accept_prob > rnd->get_random_double()));
 
-	feat.thresh = (rnd->get_random_double()*256 - 128)/2.0;
+unsigned long ShapePredictorTrainer::get_validation_interval (
+) const { return _validation_interval; }
 
-	return feat;
+
+void ShapePredictorTrainer::set_validation_interval (
+	unsigned long trees
+)
+{
+	assert(trees > 0);
+	_validation_interval = trees;
 }
 
 
-/**
- * Generate a bunch of random splits, test them and return the best one.
- */
-SplitFeature ShapePredictorTrainer::generate_split (
-	const std::vector<TrainingSample>& samples,
-	unsigned long begin,
-	unsigned long end,
-	const std::vector<cv::Point2f >& pixel_coordinates,
-	const cv::Mat& sum,
-	cv::Mat& left_sum,
-	cv::Mat& right_sum
-) const
+unsigned long ShapePredictorTrainer::get_early_stopping_patience (
+) const { return _early_stopping_patience; }
+
+
+double ShapePredictorTrainer::get_early_stopping_tolerance (
+) const { return _early_stopping_tolerance; }
+
+
+void ShapePredictorTrainer::set_early_stopping (
+	unsigned long patience,
+	double tolerance
+)
 {
-	const unsigned long num_test_splits = get_num_test_splits();
+	_early_stopping_patience = patience;
+	_early_stopping_tolerance = tolerance;
+}
 
-	// sample the random features we test in this function
-	std::vector<SplitFeature> feats;
-	feats.reserve(num_test_splits);
-	for (unsigned long i = 0; i < num_test_splits; ++i)
-		feats.push_back(randomly_generate_split_feature(pixel_coordinates));
 
-	std::vector<cv::Mat > left_sums(num_test_splits);
-	std::vector<unsigned long> left_cnt(num_test_splits);
+const std::string &ShapePredictorTrainer::get_checkpoint_file (
+) const { return _checkpoint_file; }
 
-	// now compute the sums of vectors that go left for each feature
-	Mat temp;
-	for (unsigned long j = begin; j < end; ++j)
-	{
-		temp = samples[j].target_shape-samples[j].current_shape;
-		for (unsigned long i = 0; i < num_test_splits; ++i)
-		{
-			if (samples[j].feature_pixel_values[feats[i].idx1] - samples[j].feature_pixel_values[feats[i].idx2] > feats[i].thresh)
-			{
-				if (left_sums[i].rows == 0)
-					temp.copyTo(left_sums[i]);
-				else
-					left_sums[i] += temp;
-				++left_cnt[i];
-			}
-		}
-	}
 
-	// now figure out which feature is the best
-	double best_score = -1;
-	unsigned long best_feat = 0;
+void ShapePredictorTrainer::set_checkpoint_file (
+	const std::string &fileName,
+	unsigned long interval
+)
+{
+	_checkpoint_file = fileName;
+	_checkpoint_interval = interval;
+}
+
+
+bool ShapePredictorTrainer::get_resume (
+) const { return _resume; }
+
+
+void ShapePredictorTrainer::set_resume (
+	bool resume
+)
+{
+	_resume = resume;
+}
+
+void ShapePredictorTrainer::be_verbose (
+)
+{
+	_verbose = true;
+}
+
+void ShapePredictorTrainer::be_quiet (
+)
+{
+	_verbose = false;
+}
+
+
+
+std::vector<ShapePredictor> ShapePredictorTrainer::train_part_groups (
+	const std::vector<Mat*>& images,
+	const std::vector<std::vector<ObjectDetection*> >& objects,
+	const std::vector<std::vector<unsigned long> >& part_groups
+) const
+{
+	// The objects of every group, with only the parts of the group. The
+	// feature pixel values cannot be shared by the groups since the feature
+	// pools are anchored to the parts of each group (and the current shapes
+	// diverge after the first tree).
+	size_t num_objects = 0;
+	for (size_t i = 0; i < objects.size(); ++i)
+		num_objects += objects[i].size();
+	std::vector<ObjectDetection> subsets;
+	subsets.reserve(num_objects * part_groups.size());
+	std::vector<std::vector<std::vector<ObjectDetection*> > > group_objects(part_groups.size());
+	for (size_t g = 0; g < part_groups.size(); ++g)
+	{
+		group_objects[g].resize(objects.size());
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			for (size_t j = 0; j < objects[i].size(); ++j)
+			{
+				subsets.push_back(objects[i][j]->subset(part_groups[g]));
+				group_objects[g][i].push_back(&subsets.back());
+			}
+		}
+	}
+
+	// Every group gets a share of the threads. The forks of the multi-process
+	// mode do not mix with threads, so in that mode the groups run in sequence.
+	const int concurrent = (get_num_processes() > 1) ? 1 : std::max(1, (int) part_groups.size());
+#ifdef _OPENMP
+	const int num_threads = omp_get_max_threads();
+	const int nested = omp_get_nested();
+	omp_set_nested(1);
+#endif
+
+	std::vector<ShapePredictor> models(part_groups.size());
+	std::vector<std::string> errors(part_groups.size());
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(concurrent)
+	for (long g = 0; g < (long) part_groups.size(); ++g)
+	{
+#ifdef _OPENMP
+		omp_set_num_threads(std::max(1, num_threads / concurrent));
+#endif
+		try
+		{
+			// the initial state and the warm start model have the parts of
+			// the full objects
+			ShapePredictorTrainer trainer(*this);
+			trainer.set_initial_state(NULL);
+			trainer.set_warm_start(NULL);
+			if (!_mirror_map.empty())
+			{
+				// the mirror map in terms of the parts of the group
+				const std::vector<unsigned long> &group = part_groups[g];
+				std::vector<unsigned long> map(group.size());
+				for (size_t a = 0; a < group.size(); ++a)
+				{
+					std::vector<unsigned long>::const_iterator it =
+						std::find(group.begin(), group.end(), _mirror_map.at(group[a]));
+					if (it == group.end())
+						throw std::runtime_error("The part groups must contain the mirror of each part");
+					map[a] = it - group.begin();
+				}
+				trainer.set_mirror_map(map);
+			}
+			std::stringstream suffix;
+			suffix << "." << g;
+			if (!get_checkpoint_file().empty())
+				trainer.set_checkpoint_file(get_checkpoint_file() + suffix.str(), _checkpoint_interval);
+			if (!get_telemetry_file().empty())
+				trainer.set_telemetry_file(get_telemetry_file() + suffix.str());
+			if (concurrent > 1)
+				trainer.be_quiet();
+
+			models[g] = trainer.train(images, group_objects[g]);
+		} catch (std::exception &e)
+		{
+			errors[g] = e.what();
+		}
+
+		if (_verbose && concurrent > 1)
+		{
+			#pragma omp critical
+			std::cout << "Finished the model of group " << g << std::endl;
+		}
+	}
+
+#ifdef _OPENMP
+	omp_set_nested(nested);
+	omp_set_num_threads(num_threads);
+#endif
+
+	for (size_t g = 0; g < errors.size(); ++g)
+	{
+		if (!errors[g].empty())
+			throw std::runtime_error(errors[g]);
+	}
+	return models;
+}
+
+
+void ShapePredictorTrainer::augment_training_data (
+	const std::vector<Mat*>& images,
+	const std::vector<std::vector<ObjectDetection*> >& objects,
+	SampleStorage &storage,
+	std::vector<Mat> &crops,
+	std::vector<ObjectDetection> &holder,
+	std::vector<Mat*> &augmented_images,
+	std::vector<std::vector<ObjectDetection*> > &augmented_objects
+) const
+{
+	const uint64_t seed = RandomStream::hash_seed(get_random_seed());
+	const unsigned long amount = get_augmentation_amount();
+
+	// one copy for each object and variant (in this order)
+	std::vector<std::pair<unsigned long, unsigned long> > sources;
+	for (unsigned long i = 0; i < objects.size(); ++i)
+	{
+		for (unsigned long j = 0; j < objects[i].size(); ++j)
+		{
+			if (!_mirror_map.empty() && objects[i][j]->num_parts() != _mirror_map.size())
+				throw std::runtime_error("The mirror map does not match the number of parts");
+			sources.push_back(std::make_pair(i, j));
+		}
+	}
+	const long count = (long) (sources.size() * amount);
+
+	// The transform of each copy maps the face center to the center of a
+	// crop twice as large as the (scaled) face box, so the rotated faces are
+	// still inside it. The sizes are known in advance, so the crops are views
+	// of a few buffers of bounded size.
+	std::vector<Mat> transforms(count);
+	std::vector<Rect> boxes(count);
+	std::vector<bool> mirrored(count);
+	std::vector<size_t> blocks(count), offsets(count);
+	std::vector<size_t> block_sizes;
+	for (long k = 0; k < count; ++k)
+	{
+		const unsigned long i = sources[k / amount].first;
+		const unsigned long j = sources[k / amount].second;
+		const unsigned long variant = k % amount;
+		RandomStream rnd(seed, RandomStream::AUGMENTATION, i, j, variant);
+
+		const double angle = (rnd.get_random_double() * 2 - 1) * get_rotation_jitter();
+		const double scale = 1 + (rnd.get_random_double() * 2 - 1) * get_scale_jitter();
+		mirrored[k] = !_mirror_map.empty() && variant % 2 == 0;
+
+		const Rect &rect = objects[i][j]->get_rect();
+		const int width = std::max(1, (int) (rect.width * scale + 0.5));
+		const int height = std::max(1, (int) (rect.height * scale + 0.5));
+		boxes[k] = Rect(width / 2, height / 2, width, height);
+
+		const double radians = angle * CV_PI / 180;
+		const double a = scale * std::cos(radians), b = scale * std::sin(radians);
+		const double flip = (mirrored[k]) ? -1 : 1;
+		const double cx = rect.x + rect.width / 2.0, cy = rect.y + rect.height / 2.0;
+		Mat &M = transforms[k];
+		M = Mat(2, 3, CV_64F);
+		M.at<double>(0, 0) = a * flip;
+		M.at<double>(0, 1) = -b;
+		M.at<double>(1, 0) = b * flip;
+		M.at<double>(1, 1) = a;
+		M.at<double>(0, 2) = width - (M.at<double>(0, 0) * cx + M.at<double>(0, 1) * cy);
+		M.at<double>(1, 2) = height - (M.at<double>(1, 0) * cx + M.at<double>(1, 1) * cy);
+
+		// each buffer is a single matrix row, so its size must fit in an int
+		const double bytes = (double) width * 2 * height * 2 * images[i]->elemSize();
+		if (bytes > INT_MAX - 15)
+			throw std::runtime_error("The augmented copy of a face is too large");
+		const size_t aligned = ((size_t) bytes + 15) & ~((size_t) 15);
+		if (block_sizes.empty() || (block_sizes.back() != 0 && block_sizes.back() + aligned > CROP_BLOCK_SIZE))
+			block_sizes.push_back(0);
+		blocks[k] = block_sizes.size() - 1;
+		offsets[k] = block_sizes.back();
+		block_sizes.back() += aligned;
+	}
+
+	std::vector<Mat> buffers(block_sizes.size());
+	for (size_t b = 0; b < buffers.size(); ++b)
+		buffers[b] = storage.allocate(1, (int) std::max(block_sizes[b], (size_t) 1), CV_8U);
+	crops.resize(count);
+	holder.resize(count);
+	#pragma omp parallel for schedule(dynamic, 16)
+	for (long k = 0; k < count; ++k)
+	{
+		const unsigned long i = sources[k / amount].first;
+		const ObjectDetection &object = *objects[i][sources[k / amount].second];
+		const Mat &M = transforms[k];
+
+		crops[k] = Mat(boxes[k].height * 2, boxes[k].width * 2, images[i]->type(), buffers[blocks[k]].data + offsets[k]);
+		cv::warpAffine(*images[i], crops[k], M, crops[k].size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+
+		// mirrored faces also swap the parts of each side
+		std::vector<Point2f> parts(object.num_parts());
+		for (unsigned long p = 0; p < parts.size(); ++p)
+		{
+			const Point2f &point = object.part(p);
+			const unsigned long target = (mirrored[k]) ? _mirror_map[p] : p;
+			parts[target] = Point2f(
+				(float) (M.at<double>(0, 0) * point.x + M.at<double>(0, 1) * point.y + M.at<double>(0, 2)),
+				(float) (M.at<double>(1, 0) * point.x + M.at<double>(1, 1) * point.y + M.at<double>(1, 2)));
+		}
+		holder[k] = ObjectDetection(boxes[k], parts);
+	}
+
+	for (long k = 0; k < count; ++k)
+	{
+		augmented_images.push_back(&crops[k]);
+		augmented_objects.push_back(std::vector<ObjectDetection*>(1, &holder[k]));
+	}
+}
+
+
+void ShapePredictorTrainer::prepare_initial_state (
+	const std::vector<Mat*>& images,
+	const std::vector<std::vector<ObjectDetection*> >& objects,
+	InitialTrainingState &state
+) const
+{
+	assert(images.size() == objects.size() && images.size() > 0);
+
+	// The augmented copies are made here and the state is prepared from the
+	// extended lists. The crops are only needed to extract the features of the
+	// first level, so they are released afterwards: 'train' makes the same
+	// (deterministic) copies again, in the same order as the state samples.
+	if (get_augmentation_amount() > 0 && !_augmented)
+	{
+		SampleStorage crop_storage("");
+		std::vector<Mat> crops;
+		std::vector<ObjectDetection> holder;
+		std::vector<Mat*> all_images(images);
+		std::vector<std::vector<ObjectDetection*> > all_objects(objects);
+		augment_training_data(images, objects, crop_storage, crops, holder, all_images, all_objects);
+
+		ShapePredictorTrainer trainer(*this);
+		trainer._augmented = true;
+		trainer.prepare_initial_state(all_images, all_objects, state);
+		return;
+	}
+
+	// the state is always kept in memory
+	SampleStorage storage("");
+	state.initial_shape = populate_training_sample_shapes(objects, state.samples, storage);
+	state.feature_pixel_values = allocate_feature_pixel_values(state.samples, storage);
+	state.pixel_coordinates = randomly_sample_pixel_coordinates(state.initial_shape);
+	extract_feature_pixel_values(images, state.samples, state.initial_shape, state.pixel_coordinates[0]);
+}
+
+
+ShapePredictor ShapePredictorTrainer::train (
+	const std::vector<Mat*>& images,
+	const std::vector<std::vector<ObjectDetection*> >& objects
+) const
+{
+	return train(images, objects, std::vector<Mat*>(), std::vector<std::vector<ObjectDetection*> >());
+}
+
+
+ShapePredictor ShapePredictorTrainer::train (
+	const std::vector<Mat*>& images,
+	const std::vector<std::vector<ObjectDetection*> >& objects,
+	const std::vector<Mat*>& validation_images,
+	const std::vector<std::vector<ObjectDetection*> >& validation_objects
+) const
+{
+	assert(images.size() == objects.size() && images.size() > 0);
+	assert(validation_images.size() == validation_objects.size());
+	/*DLIB_CASSERT(images.size() == objects.size() && images.size() > 0,
+		"\t shape_predictor shape_predictor_trainer::train()"
+		<< "\n\t Invalid inputs were given to this function. "
+		<< "\n\t images.size():  " << images.size()
+		<< "\n\t objects.size(): " << objects.size()
+	);*/
+
+	// make sure the objects agree on the number of parts and that there is at
+	// least one FullObjectDetection.
+	unsigned long num_parts = 0;
+	for (unsigned long i = 0; i < objects.size(); ++i)
+	{
+		for (unsigned long j = 0; j < objects[i].size(); ++j)
+		{
+			if (num_parts == 0)
+			{
+				num_parts = objects[i][j]->num_parts();
+				assert(objects[i][j]->num_parts() != 0);
+				/*DLIB_CASSERT(objects[i][j].num_parts() != 0,
+					"\t shape_predictor shape_predictor_trainer::train()"
+					<< "\n\t You can't give objects that don't have any parts to the trainer."
+				);*/
+			}
+			else
+			{
+				assert(objects[i][j]->num_parts() == num_parts);
+				/*DLIB_CASSERT(objects[i][j].num_parts() == num_parts,
+					"\t shape_predictor shape_predictor_trainer::train()"
+					<< "\n\t All the objects must agree on the number of parts. "
+					<< "\n\t objects["<<i<<"]["<<j<<"].num_parts(): " << objects[i][j].num_parts()
+					<< "\n\t num_parts:  " << num_parts
+				);*/
+			}
+		}
+	}
+	/*DLIB_CASSERT(num_parts != 0,
+		"\t shape_predictor shape_predictor_trainer::train()"
+		<< "\n\t You must give at least one full_object_detection if you want to train a shape model and it must have parts."
+	);*/
+
+	// The augmented copies are made once and the training runs on the extended
+	// lists (marked as augmented, so the augmentation parameters still reach
+	// the checkpoints). The copies are deterministic, so they match the
+	// samples of an initial state prepared with augmentation.
+	if (get_augmentation_amount() > 0 && !_augmented)
+	{
+		SampleStorage crop_storage(get_spill_directory(), get_num_processes() > 1);
+		std::vector<Mat> crops;
+		std::vector<ObjectDetection> holder;
+		std::vector<Mat*> all_images(images);
+		std::vector<std::vector<ObjectDetection*> > all_objects(objects);
+		augment_training_data(images, objects, crop_storage, crops, holder, all_images, all_objects);
+
+		ShapePredictorTrainer trainer(*this);
+		trainer._augmented = true;
+		return trainer.train(all_images, all_objects, validation_images, validation_objects);
+	}
+
+	// Training with several processes only supports the basic options
+	const bool distributed = get_num_processes() > 1;
+	if (distributed && (!validation_objects.empty() || get_split_strategy() != SPLIT_RANDOM_THRESHOLD ||
+		get_tree_subsampling_fraction() < 1 || get_split_subsampling_size() != 0))
+		throw std::runtime_error("Training with several processes does not support validation, histogram splits or subsampling");
+
+	// the samples buffers must outlive the samples (and are shared by the
+	// processes, so the coordinator can see every current shape)
+	SampleStorage storage(get_spill_directory(), distributed);
+	std::vector<TrainingSample> samples;
+	Mat initial_shape;
+	std::vector<std::vector<Point2f > > pixel_coordinates;
+	std::vector<std::vector<RegressionTree> > forests;
+
+	// The checkpoint (if any) keeps the training samples with the feature pixel
+	// values of the current cascade level, so we can continue right away.
+	unsigned long first_cascade = 0, first_tree = 0;
+	bool level_finished = false;
+	LevelState resumed_level;
+	// whether the samples already have the feature pixel values of the first level
+	bool shared_features = false;
+	const bool from_checkpoint = get_resume() && !get_checkpoint_file().empty() &&
+		load_checkpoint(initial_shape, pixel_coordinates, forests, samples, storage, first_cascade, first_tree, level_finished, resumed_level);
+	bool resumed = from_checkpoint;
+	if (resumed)
+	{
+		if (_verbose)
+			std::cout << "Resuming from cascade " << first_cascade + 1 << ", tree " << first_tree + 1 << std::endl;
+		// the checkpoint only keeps the levels trained so far
+		if (_warm_start != NULL)
+		{
+			for (unsigned long i = first_cascade + 1; i < _warm_start->num_cascades(); ++i)
+				forests[i] = _warm_start->get_forests()[i];
+		}
+		if (level_finished)
+		{
+			// the feature pixel values are from a finished level
+			++first_cascade;
+			first_tree = 0;
+			resumed = false;
+		}
+	}
+	else
+	if (_initial_state != NULL && _warm_start == NULL)
+	{
+		if (_initial_state->pixel_coordinates.size() < get_cascade_depth() ||
+			_initial_state->pixel_coordinates[0].size() != get_feature_pool_size())
+			throw std::runtime_error("The initial training state does not match the trainer parameters");
+
+		initial_shape = _initial_state->initial_shape;
+		pixel_coordinates.assign(_initial_state->pixel_coordinates.begin(),
+			_initial_state->pixel_coordinates.begin() + get_cascade_depth());
+		// the current shapes and the feature pixel values are updated in
+		// place, so they cannot be shared
+		samples = _initial_state->samples;
+		allocate_current_shapes(samples, storage);
+		allocate_feature_pixel_values(samples, storage);
+		forests.resize(get_cascade_depth());
+		shared_features = true;
+	}
+	else
+	{
+		// compute the initial shape guests for each training sample
+		initial_shape = populate_training_sample_shapes(objects, samples, storage);
+		allocate_feature_pixel_values(samples, storage);
+		pixel_coordinates = randomly_sample_pixel_coordinates(initial_shape);
+		forests.resize(get_cascade_depth());
+
+		if (_warm_start != NULL)
+			prepare_warm_start(*_warm_start, initial_shape, pixel_coordinates, forests, samples);
+	}
+
+	// The validation samples start from the initial shape and are updated by
+	// the trees just like the training samples.
+	const bool use_validation = !validation_objects.empty();
+	std::vector<TrainingSample> validation_samples;
+	if (use_validation)
+	{
+		populate_validation_samples(validation_objects, initial_shape, validation_samples, storage);
+		// catch up with the trees restored from the checkpoint
+		for (unsigned long cascade = 0; cascade < first_cascade + (resumed ? 1 : 0); ++cascade)
+		{
+			extract_feature_pixel_values(validation_images, validation_samples, initial_shape, pixel_coordinates[cascade]);
+			for (size_t i = 0; i < forests[cascade].size(); ++i)
+				apply_tree(forests[cascade][i], validation_samples);
+		}
+	}
+
+	// With several processes, everything from here on runs in every process
+	// of the group, each one with its own shard of the samples. The trees are
+	// built by 'make_shared_regression_tree'.
+#ifdef _OPENMP
+	const int num_threads = omp_get_max_threads();
+	if (distributed) omp_set_num_threads(1);
+#endif
+	ProcessGroup group(get_num_processes(), (distributed) ? compute_shared_tree_size(initial_shape.cols) : 0);
+	const unsigned long shard_begin = samples.size() * group.get_rank() / group.get_size();
+	const unsigned long shard_end = samples.size() * (group.get_rank() + 1) / group.get_size();
+	const bool verbose = _verbose && group.get_rank() == 0;
+
+	unsigned long trees_fit_so_far = first_cascade * get_num_trees_per_cascade_level() + first_tree;
+	ProgressIndicator pbar(get_cascade_depth()*get_num_trees_per_cascade_level());
+	if (verbose)
+		std::cout << "Fitting trees..." << std::endl;
+
+//for (int i = 0; i < 68; ++i)
+//std::cout << "part[" << i << "] = " << objects[0][0]->part(i) << std::endl;
+
+	time_t last_checkpoint = time(NULL);
+	// a resumed training adds its figures to the ones written before
+	TrainingTelemetry telemetry((group.get_rank() == 0) ? get_telemetry_file() : "", from_checkpoint);
+	unsigned long trees_fit = 0;
+
+	// Now start doing the actual training by filling in the forests
+	for (unsigned long cascade = first_cascade; cascade < get_cascade_depth(); ++cascade)
+	{
+		telemetry.begin_cascade();
+		const unsigned long level_start = forests[cascade].size();
+
+		// First compute the feature_pixel_values for each training sample at this
+		// level of the cascade.
+		double start = TrainingTelemetry::now();
+		const bool fresh_level = !resumed || cascade != first_cascade;
+		if (fresh_level && !(shared_features && cascade == 0))
+			extract_feature_pixel_values(images, samples, initial_shape, pixel_coordinates[cascade], shard_begin, shard_end);
+		if (use_validation && fresh_level)
+			extract_feature_pixel_values(validation_images, validation_samples, initial_shape, pixel_coordinates[cascade]);
+		telemetry.add_time(TrainingTelemetry::FEATURE_EXTRACTION, start);
+
+		// Trees inherited from the warm start model are not yet applied
+		if (fresh_level)
+		{
+			for (size_t i = 0; i < forests[cascade].size(); ++i)
+			{
+				apply_tree(forests[cascade][i], samples, 1, shard_begin, shard_end);
+				if (use_validation)
+					apply_tree(forests[cascade][i], validation_samples);
+			}
+		}
+
+		// With a validation set, the level stops once the validation error stops
+		// improving (i.e. 'patience' checks without improving more than the
+		// tolerance) and keeps only the trees up to the smallest error. A
+		// resumed level continues with the state saved in the checkpoint.
+		LevelState level;
+		if (fresh_level)
+		{
+			level.best_error = (use_validation) ? compute_error(validation_samples) : 0;
+			level.reference_error = level.best_error;
+			level.best_trees = forests[cascade].size();
+		}
+		else
+			level = resumed_level;
+		bool stopped = false;
+
+		// The split features of this level are pixel pairs drawn from a fixed
+		// distribution, so we build its sampling table once.
+		const AliasTable pixel_pairs(compute_pixel_pair_weights(pixel_coordinates[cascade]));
+
+		// Now start building the trees at this cascade level.
+		forests[cascade].reserve( get_num_trees_per_cascade_level() );
+		for (unsigned long i = forests[cascade].size(); i < get_num_trees_per_cascade_level() && !stopped; ++i)
+		{
+			if (distributed)
+				forests[cascade].push_back(make_shared_regression_tree(samples, shard_begin, shard_end,
+					pixel_pairs, cascade, i, group, telemetry));
+			else
+				forests[cascade].push_back(make_regression_tree(samples, pixel_pairs, cascade, i,
+					level.residual_sum, telemetry));
+
+			if (verbose)
+			{
+				++trees_fit_so_far;
+				pbar.update(trees_fit_so_far, true);
+			}
+
+			start = TrainingTelemetry::now();
+			if (use_validation)
+			{
+				apply_tree(forests[cascade].back(), validation_samples);
+
+				if ((i + 1) % get_validation_interval() == 0)
+				{
+					const double error = compute_error(validation_samples);
+					if (error < level.best_error)
+					{
+						level.best_error = error;
+						level.best_trees = i + 1;
+					}
+					if (error < level.reference_error * (1 - get_early_stopping_tolerance()))
+					{
+						level.reference_error = error;
+						level.checks_without_improvement = 0;
+					}
+					else
+					if (get_early_stopping_patience() != 0 &&
+						++level.checks_without_improvement >= get_early_stopping_patience())
+						stopped = true;
+				}
+			}
+			telemetry.add_time(TrainingTelemetry::VALIDATION, start);
+
+			if (stopped)
+			{
+				// remove the trees after the smallest validation error and undo
+				// their predictions
+				for (unsigned long k = forests[cascade].size(); k > level.best_trees; --k)
+				{
+					apply_tree(forests[cascade][k - 1], samples, -1);
+					apply_tree(forests[cascade][k - 1], validation_samples, -1);
+				}
+				forests[cascade].resize(level.best_trees);
+
+				if (verbose)
+				{
+					std::cout << "Cascade " << cascade + 1 << " stopped with " << level.best_trees <<
+						" trees (validation error " << level.best_error << ")" << std::endl;
+					trees_fit_so_far = (cascade + 1) * get_num_trees_per_cascade_level();
+				}
+			}
+
+			// Save the training state from time to time and at the end of
+			// each cascade level. With several processes the coordinator saves
+			// it: the sample buffers are shared, and its own sample headers
+			// still point to the rows of every sample. The workers wait, so
+			// they do not change the samples while they are saved.
+			const bool finished = stopped || i + 1 == get_num_trees_per_cascade_level();
+			if (!get_checkpoint_file().empty() && group.get_rank() == 0 &&
+				(time(NULL) - last_checkpoint >= (time_t) _checkpoint_interval || finished))
+			{
+				start = TrainingTelemetry::now();
+				save_checkpoint(initial_shape, pixel_coordinates, forests, samples, cascade,
+					forests[cascade].size(), finished, level);
+				last_checkpoint = time(NULL);
+				telemetry.add_time(TrainingTelemetry::CHECKPOINT, start);
+			}
+			if (distributed && !get_checkpoint_file().empty())
+				group.barrier();
+		}
+
+		const unsigned long level_trees = (forests[cascade].size() > level_start) ? forests[cascade].size() - level_start : 0;
+		trees_fit += level_trees;
+		telemetry.end_cascade(cascade, level_trees, samples.size(), compute_error(samples),
+			(use_validation) ? compute_error(validation_samples) : -1);
+	}
+	telemetry.finish(trees_fit, samples.size());
+
+	// the workers end here
+	group.finish();
+#ifdef _OPENMP
+	omp_set_num_threads(num_threads);
+#endif
+
+	if (verbose)
+		std::cout << "Training complete                          " << std::endl;
+
+	return ShapePredictor(initial_shape, forests, pixel_coordinates);
+}
+
+
+
+void ShapePredictorTrainer::serialize_parameters (
+	std::ostream &out
+) const
+{
+	Serializable::serialize(out, (uint64_t) get_cascade_depth());
+	Serializable::serialize(out, (uint64_t) get_tree_depth());
+	Serializable::serialize(out, (uint64_t) get_num_trees_per_cascade_level());
+	Serializable::serialize(out, get_nu());
+	Serializable::serialize(out, (uint64_t) get_oversampling_amount());
+	Serializable::serialize(out, (uint64_t) get_feature_pool_size());
+	Serializable::serialize(out, get_lambda());
+	Serializable::serialize(out, (uint64_t) get_num_test_splits());
+	Serializable::serialize(out, get_feature_pool_region_padding());
+	Serializable::serialize(out, (uint32_t) get_split_strategy());
+	Serializable::serialize(out, get_tree_subsampling_fraction());
+	Serializable::serialize(out, (uint64_t) get_split_subsampling_size());
+	Serializable::serialize(out, (uint64_t) get_validation_interval());
+	Serializable::serialize(out, (uint64_t) get_early_stopping_patience());
+	Serializable::serialize(out, get_early_stopping_tolerance());
+	Serializable::serialize(out, (uint64_t) get_augmentation_amount());
+	Serializable::serialize(out, get_rotation_jitter());
+	Serializable::serialize(out, get_scale_jitter());
+	Serializable::serialize(out, (uint64_t) _mirror_map.size());
+	for (size_t i = 0; i < _mirror_map.size(); ++i)
+		Serializable::serialize(out, (uint64_t) _mirror_map[i]);
+	Serializable::serialize(out, (uint32_t) get_random_seed().length());
+	out.write(get_random_seed().c_str(), get_random_seed().length());
+}
+
+
+bool ShapePredictorTrainer::check_parameters (
+	std::istream &in
+) const
+{
+	std::stringstream expected;
+	serialize_parameters(expected);
+
+	std::string current = expected.str();
+	std::vector<char> stored(current.length());
+	if (stored.size() > 0)
+		in.read(&stored[0], stored.size());
+
+	return in.good() && std::equal(stored.begin(), stored.end(), current.begin());
+}
+
+
+void ShapePredictorTrainer::save_checkpoint (
+	const cv::Mat &initial_shape,
+	const std::vector<std::vector<cv::Point2f> > &pixel_coordinates,
+	const std::vector<std::vector<RegressionTree> > &forests,
+	const std::vector<TrainingSample> &samples,
+	unsigned long cascade,
+	unsigned long trees,
+	bool finished,
+	const LevelState &level
+) const
+{
+	// write in a temporary file first, so an interruption while saving does
+	// not destroy the previous checkpoint
+	const std::string tempFile = get_checkpoint_file() + ".tmp";
+	std::ofstream out(tempFile.c_str(), std::ios::binary);
+
+	Serializable::serialize(out, CHECKPOINT_MAGIC);
+	Serializable::serialize(out, CHECKPOINT_VERSION);
+	serialize_parameters(out);
+
+	// The random streams depend only on the seed and on the position in the
+	// training, so the position is all we need to restore them.
+	Serializable::serialize(out, (uint64_t) cascade);
+	Serializable::serialize(out, (uint64_t) trees);
+	Serializable::serialize(out, finished);
+	Serializable::serialize(out, level.best_error);
+	Serializable::serialize(out, level.reference_error);
+	Serializable::serialize(out, (uint64_t) level.best_trees);
+	Serializable::serialize(out, (uint64_t) level.checks_without_improvement);
+	// the residual sum is empty when the trees use a subset of the samples
+	Serializable::serialize(out, !level.residual_sum.empty());
+	if (!level.residual_sum.empty())
+		Serializable::serialize(out, level.residual_sum);
+
+	Serializable::serialize(out, initial_shape);
+	for (size_t i = 0; i < pixel_coordinates.size(); ++i)
+		for (size_t j = 0; j < pixel_coordinates[i].size(); ++j)
+			Serializable::serialize(out, pixel_coordinates[i][j]);
+
+	for (unsigned long i = 0; i <= cascade; ++i)
+	{
+		Serializable::serialize(out, (uint64_t) forests[i].size());
+		for (size_t j = 0; j < forests[i].size(); ++j)
+			forests[i][j].serialize(out);
+	}
+
+	// The oversampled copies of an object share its target shape (see
+	// populate_training_sample_shapes), so the distinct target shapes are
+	// saved once in a table and each sample keeps its index in the table.
+	std::map<const uchar*, uint64_t> target_index;
+	std::vector<uint64_t> sample_targets(samples.size());
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		std::map<const uchar*, uint64_t>::iterator it = target_index.find(samples[i].target_shape.data);
+		if (it == target_index.end())
+			it = target_index.insert(std::make_pair(samples[i].target_shape.data, (uint64_t) target_index.size())).first;
+		sample_targets[i] = it->second;
+	}
+	const int rows = (samples.empty()) ? 0 : samples[0].target_shape.rows;
+	const int cols = (samples.empty()) ? 0 : samples[0].target_shape.cols;
+	cv::Mat target_shapes(rows * (int) target_index.size(), cols, CV_64F);
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		cv::Mat row = target_shapes.rowRange((int) (rows * sample_targets[i]), (int) (rows * (sample_targets[i] + 1)));
+		samples[i].target_shape.copyTo(row);
+	}
+	Serializable::serialize(out, (uint64_t) target_index.size());
+	Serializable::serialize(out, target_shapes);
+
+	// The samples are saved in their current order, since the order changes
+	// as the trees are built. The feature pixel values are always integers in
+	// the range [0, 255].
+	Serializable::serialize(out, (uint64_t) samples.size());
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		const TrainingSample &sample = samples[i];
+		Serializable::serialize(out, (uint64_t) sample.image_idx);
+		Serializable::serialize(out, (int32_t) sample.rect.x);
+		Serializable::serialize(out, (int32_t) sample.rect.y);
+		Serializable::serialize(out, (int32_t) sample.rect.width);
+		Serializable::serialize(out, (int32_t) sample.rect.height);
+		Serializable::serialize(out, sample_targets[i]);
+		Serializable::serialize(out, sample.current_shape);
+		out.write((const char*) sample.feature_pixel_values, get_feature_pool_size());
+	}
+
+	out.close();
+	if (!out.good() || std::rename(tempFile.c_str(), get_checkpoint_file().c_str()) != 0)
+		throw std::runtime_error("Unable to write the checkpoint file " + get_checkpoint_file());
+}
+
+
+bool ShapePredictorTrainer::load_checkpoint (
+	cv::Mat &initial_shape,
+	std::vector<std::vector<cv::Point2f> > &pixel_coordinates,
+	std::vector<std::vector<RegressionTree> > &forests,
+	std::vector<TrainingSample> &samples,
+	SampleStorage &storage,
+	unsigned long &cascade,
+	unsigned long &trees,
+	bool &finished,
+	LevelState &level
+) const
+{
+	std::ifstream in(get_checkpoint_file().c_str(), std::ios::binary);
+	if (!in.good()) return false;
+
+	uint32_t magic = 0, version = 0;
+	Serializable::deserialize(in, magic);
+	Serializable::deserialize(in, version);
+	if (magic != CHECKPOINT_MAGIC || version != CHECKPOINT_VERSION)
+		throw std::runtime_error("Invalid checkpoint file " + get_checkpoint_file());
+	if (!check_parameters(in))
+		throw std::runtime_error("The checkpoint " + get_checkpoint_file() + " was created with different training parameters");
+
+	uint64_t value;
+	Serializable::deserialize(in, value);
+	cascade = value;
+	Serializable::deserialize(in, value);
+	trees = value;
+	Serializable::deserialize(in, finished);
+	Serializable::deserialize(in, level.best_error);
+	Serializable::deserialize(in, level.reference_error);
+	Serializable::deserialize(in, value);
+	level.best_trees = value;
+	Serializable::deserialize(in, value);
+	level.checks_without_improvement = value;
+	bool has_residual_sum = false;
+	Serializable::deserialize(in, has_residual_sum);
+	if (has_residual_sum)
+		Serializable::deserialize(in, level.residual_sum);
+	else
+		level.residual_sum.release();
+
+	Serializable::deserialize(in, initial_shape);
+	pixel_coordinates.resize(get_cascade_depth());
+	for (size_t i = 0; i < pixel_coordinates.size(); ++i)
+	{
+		pixel_coordinates[i].resize(get_feature_pool_size());
+		for (size_t j = 0; j < pixel_coordinates[i].size(); ++j)
+			Serializable::deserialize(in, pixel_coordinates[i][j]);
+	}
+
+	forests.clear();
+	forests.resize(get_cascade_depth());
+	for (unsigned long i = 0; i <= cascade; ++i)
+	{
+		Serializable::deserialize(in, value);
+		forests[i].resize(value);
+		for (size_t j = 0; j < forests[i].size(); ++j)
+			forests[i][j].deserialize(in);
+	}
+
+	// the samples reference the rows of the shared target shape table
+	uint64_t num_targets;
+	cv::Mat target_shapes;
+	Serializable::deserialize(in, num_targets);
+	Serializable::deserialize(in, target_shapes);
+	if (num_targets == 0 || target_shapes.rows % num_targets != 0)
+		num_targets = 0;
+	const int rows = (num_targets == 0) ? 0 : target_shapes.rows / (int) num_targets;
+
+	Serializable::deserialize(in, value);
+	samples.clear();
+	samples.resize(value);
+	allocate_feature_pixel_values(samples, storage);
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		TrainingSample &sample = samples[i];
+		Serializable::deserialize(in, value);
+		sample.image_idx = value;
+		Serializable::deserialize(in, sample.rect.x);
+		Serializable::deserialize(in, sample.rect.y);
+		Serializable::deserialize(in, sample.rect.width);
+		Serializable::deserialize(in, sample.rect.height);
+		Serializable::deserialize(in, value);
+		if (value >= num_targets)
+			throw std::runtime_error("Invalid checkpoint file " + get_checkpoint_file());
+		sample.target_shape = target_shapes.rowRange((int) (rows * value), (int) (rows * (value + 1)));
+		Serializable::deserialize(in, sample.current_shape);
+		in.read((char*) sample.feature_pixel_values, get_feature_pool_size());
+	}
+	allocate_current_shapes(samples, storage);
+
+	if (!in.good())
+		throw std::runtime_error("The checkpoint file " + get_checkpoint_file() + " is truncated");
+	return true;
+}
+
+
+void ShapePredictorTrainer::extract_feature_pixel_values (
+	const std::vector<Mat*>& images,
+	std::vector<TrainingSample>& samples,
+	const Mat& initial_shape,
+	const std::vector<Point2f>& pixel_coordinates,
+	unsigned long begin,
+	unsigned long end
+) const
+{
+	end = std::min(end, (unsigned long) samples.size());
+
+	// Each cascade uses a different set of pixels for its features.  We compute
+	// their representations relative to the initial shape first.
+	std::vector<unsigned long> anchor_idx;
+	std::vector<Point2f > deltas;
+	create_shape_relative_encoding(initial_shape, pixel_coordinates, anchor_idx, deltas);
+
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (long i = begin; i < (long) end; ++i)
+	{
+		ert::extract_feature_pixel_values(*images[samples[i].image_idx], samples[i].rect,
+			samples[i].current_shape, initial_shape, anchor_idx,
+			deltas, samples[i].feature_pixel_values);
+	}
+}
+
+
+void ShapePredictorTrainer::apply_tree (
+	const RegressionTree& tree,
+	std::vector<TrainingSample>& samples,
+	double scale,
+	unsigned long begin,
+	unsigned long end
+) const
+{
+	end = std::min(end, (unsigned long) samples.size());
+	#pragma omp parallel for schedule(static)
+	for (long i = begin; i < (long) end; ++i)
+		samples[i].current_shape += scale * tree(samples[i].feature_pixel_values);
+}
+
+
+double ShapePredictorTrainer::compute_error (
+	const std::vector<TrainingSample>& samples )
+{
+	// mean distance between the current and target points, in the normalized
+	// shape space (i.e. relative to the object rectangle)
+	double error = 0;
+	unsigned long count = 0;
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		for (int j = 0; j < samples[i].target_shape.cols; ++j)
+		{
+			error += length(location(samples[i].target_shape, j) - location(samples[i].current_shape, j));
+			++count;
+		}
+	}
+	return (count == 0) ? 0 : error / count;
+}
+
+
+void ShapePredictorTrainer::populate_validation_samples (
+	const std::vector<std::vector<ObjectDetection*> >& objects,
+	const cv::Mat& initial_shape,
+	std::vector<TrainingSample>& samples,
+	SampleStorage &storage
+) const
+{
+	samples.clear();
+	for (unsigned long i = 0; i < objects.size(); ++i)
+	{
+		for (unsigned long j = 0; j < objects[i].size(); ++j)
+		{
+			TrainingSample sample;
+			sample.image_idx = i;
+			sample.rect = objects[i][j]->get_rect();
+			sample.target_shape = object_to_shape(*objects[i][j]);
+			samples.push_back(sample);
+		}
+	}
+
+	allocate_current_shapes(samples, storage);
+	allocate_feature_pixel_values(samples, storage);
+	for (size_t i = 0; i < samples.size(); ++i)
+		initial_shape.copyTo(samples[i].current_shape);
+}
+
+
+void ShapePredictorTrainer::allocate_current_shapes (
+	std::vector<TrainingSample>& samples,
+	SampleStorage &storage
+) const
+{
+	if (samples.empty()) return;
+
+	// two rows for each sample
+	const int num_parts = samples[0].target_shape.cols;
+	cv::Mat buffer = storage.allocate(2 * samples.size(), num_parts, CV_64F);
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		cv::Mat shape = buffer.rowRange(2 * i, 2 * i + 2);
+		if (!samples[i].current_shape.empty())
+			samples[i].current_shape.copyTo(shape);
+		samples[i].current_shape = shape;
+	}
+}
+
+
+cv::Mat ShapePredictorTrainer::allocate_feature_pixel_values (
+	std::vector<TrainingSample>& samples,
+	SampleStorage &storage
+) const
+{
+	// one row for each sample
+	const size_t pool_size = get_feature_pool_size();
+	cv::Mat buffer = storage.allocate(samples.size(), pool_size, CV_8U);
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		uint8_t *values = buffer.ptr<uint8_t>(i);
+		if (samples[i].feature_pixel_values != NULL)
+			std::copy(samples[i].feature_pixel_values, samples[i].feature_pixel_values + pool_size, values);
+		samples[i].feature_pixel_values = values;
+	}
+	return buffer;
+}
+
+
+void ShapePredictorTrainer::prepare_warm_start (
+	const ShapePredictor &model,
+	cv::Mat &initial_shape,
+	std::vector<std::vector<cv::Point2f> > &pixel_coordinates,
+	std::vector<std::vector<RegressionTree> > &forests,
+	std::vector<TrainingSample> &samples
+) const
+{
+	if (model.num_parts() != (unsigned long) initial_shape.cols)
+		throw std::runtime_error("The warm start model has a different number of parts");
+	if (model.num_cascades() > get_cascade_depth())
+		throw std::runtime_error("The warm start model has more cascade levels than the trainer");
+	const std::vector<std::vector<Point2f> > model_coordinates = model.get_pixel_coordinates();
+	for (unsigned long i = 0; i < model_coordinates.size(); ++i)
+	{
+		if (model_coordinates[i].size() != get_feature_pool_size())
+			throw std::runtime_error("The warm start model has a different feature pool size");
+	}
+
+	// the trees expect shapes relative to the model initial shape, so we use it
+	// in place of the mean shape
+	for (unsigned long i = 0; i < samples.size(); ++i)
+	{
+		if ((i % get_oversampling_amount()) == 0)
+			model.get_initial_shape().copyTo(samples[i].current_shape);
+	}
+	model.get_initial_shape().copyTo(initial_shape);
+
+	// the feature pools of the levels after the model ones are sampled around
+	// the new initial shape
+	pixel_coordinates = randomly_sample_pixel_coordinates(initial_shape);
+	for (unsigned long i = 0; i < model_coordinates.size(); ++i)
+	{
+		pixel_coordinates[i] = model_coordinates[i];
+		forests[i] = model.get_forests()[i];
+	}
+}
+
+
+// CHECKED!!!
+cv::Mat ShapePredictorTrainer::object_to_shape (
+	const ObjectDetection& obj )
+{
+	// create an matrix of 2xN, where N is the amount of parts
+	cv::Mat shape(2, obj.num_parts(), CV_64F);
+//std::cout << "ready for tform_from_img " << obj.get_rect() << std::endl;
+	const PointTransformAffine tform_from_img = normalizing_tform(obj.get_rect());
+//std::cout << "tform_from_img = " << tform_from_img.get_b() << std::endl;
+
+	for (unsigned long i = 0; i < obj.num_parts(); ++i)
+	{
+//std::cout << "original_point[" << i << "] = " << obj.part(i) << std::endl;
+		cv::Point2f p = tform_from_img(obj.part(i));
+//std::cout << "target_point[" << i << "] = " << p << std::endl;
+		shape.at<double>(0, i) = p.x;
+		shape.at<double>(1, i) = p.y;
+	}
+	return shape;
+}
+
+
+void ShapePredictorTrainer::printShape( const std::string& prefix, const cv::Mat& mat ) const
+{
+	std::cout << prefix;
+	for (int i = 0; i < mat.cols; ++i)
+		for (int j = 0; j < mat.rows; ++j)
+			std::cout << mat.at<double>(j,i) << std::endl;
+	std::cout << std::endl;
+}
+
+
+RegressionTree ShapePredictorTrainer::make_regression_tree (
+	std::vector<TrainingSample>& samples,
+	const AliasTable& pixel_pairs,
+	unsigned long cascade,
+	unsigned long tree_index,
+	cv::Mat &residual_sum,
+	TrainingTelemetry &telemetry
+) const
+{
+	const uint64_t seed = RandomStream::hash_seed(get_random_seed());
+
+	// With stochastic subsampling the tree is built from a random fraction of
+	// the samples, which we move to the beginning of the vector.
+	const unsigned long num_samples = samples.size();
+	unsigned long num_tree_samples = num_samples;
+	if (get_tree_subsampling_fraction() < 1)
+	{
+		num_tree_samples = std::max(1UL, (unsigned long) (get_tree_subsampling_fraction() * num_samples + 0.5));
+		RandomStream rnd(seed, RandomStream::SUBSAMPLING, cascade, tree_index);
+		for (unsigned long k = 0; k < num_tree_samples; ++k)
+		{
+			const unsigned long j = k + rnd.get_random_64bit_number() % (num_samples - k);
+			if (j != k) samples[k].swap_contents(samples[j], get_feature_pool_size());
+		}
+	}
+
+	// the range of samples covered by each node, indexed the same way as the
+	// tree (i.e. the leaves are at the end)
+	const unsigned long num_split_nodes = static_cast<unsigned long>(std::pow(2.0, (double)get_tree_depth())-1);
+	std::vector<std::pair<unsigned long, unsigned long> > parts(num_split_nodes*2+1);
+	parts[0] = std::make_pair(0, num_tree_samples);
+
+	RegressionTree tree;
+	tree.splits.resize(num_split_nodes);
+
+	const int rows = samples[0].current_shape.rows;
+	const int cols = samples[0].current_shape.cols;
+	const int dims = rows * cols;
+	std::vector<cv::Mat > sums(num_split_nodes*2+1);
+	for (unsigned long i = 0; i < sums.size(); ++i)
+		sums[i] = cv::Mat::zeros(rows, cols, CV_64F);
+
+	// The residual sum left by the previous tree covers every sample, so it is
+	// only useful when the tree uses all of them.
+	if (num_tree_samples == num_samples && !residual_sum.empty())
+		residual_sum.copyTo(sums[0]);
+	else
+	{
+		double *root = sums[0].ptr<double>();
+		for (unsigned long i = 0; i < num_tree_samples; ++i)
+		{
+			const double *target = samples[i].target_shape.ptr<double>();
+			const double *current = samples[i].current_shape.ptr<double>();
+			for (int k = 0; k < dims; ++k)
+				root[k] += target[k] - current[k];
+		}
+	}
+
+	// Nodes at the same depth cover disjoint ranges of samples, so we walk the
+	// tree one level at a time and split every node of a level concurrently.
+	// The levels near the root have less nodes than threads; in that case the
+	// nodes are processed in sequence and each split search runs in parallel.
+	const long num_threads = get_max_threads();
+	for (unsigned long depth = 0; depth < get_tree_depth(); ++depth)
+	{
+		const long first = (1L << depth) - 1;
+		const long count = 1L << depth;
+		const bool node_parallel = (count >= num_threads);
+
+		double start = TrainingTelemetry::now();
+		#pragma omp parallel for schedule(dynamic) if (node_parallel)
+		for (long n = 0; n < count; ++n)
+		{
+			const unsigned long i = first + n;
+
+			// each node has its own random stream, so the features do not
+			// depend on the order the nodes are processed
+			RandomStream rnd(seed, RandomStream::SPLITS, cascade, tree_index, i);
+			std::vector<SplitFeature> feats;
+			feats.reserve(get_num_test_splits());
+			for (unsigned long k = 0; k < get_num_test_splits(); ++k)
+				feats.push_back(randomly_generate_split_feature(pixel_pairs, rnd));
+
+			// the splits of large nodes may be tested with a random subset of
+			// the node samples
+			std::vector<unsigned long> subset;
+			const unsigned long node_size = parts[i].second - parts[i].first;
+			if (get_split_subsampling_size() != 0 && node_size > get_split_subsampling_size())
+			{
+				// Partial Fisher-Yates shuffle of the node range, so no sample
+				// is drawn twice. Only the swapped positions are stored.
+				std::map<unsigned long, unsigned long> swapped;
+				subset.resize(get_split_subsampling_size());
+				for (unsigned long k = 0; k < subset.size(); ++k)
+				{
+					const unsigned long j = k + rnd.get_random_64bit_number() % (node_size - k);
+					std::map<unsigned long, unsigned long>::iterator at_j = swapped.find(j);
+					std::map<unsigned long, unsigned long>::iterator at_k = swapped.find(k);
+					const unsigned long picked = (at_j == swapped.end()) ? j : at_j->second;
+					swapped[j] = (at_k == swapped.end()) ? k : at_k->second;
+					subset[k] = parts[i].first + picked;
+				}
+				std::sort(subset.begin(), subset.end());
+			}
+
+			tree.splits[i] = generate_split(samples, parts[i].first, parts[i].second, subset,
+				feats, sums[i], sums[left_child(i)], sums[right_child(i)], !node_parallel);
+//std::cout << "Split #" << i << " = " << tree.splits[i].thresh << " " << tree.splits[i].idx1 << " " << tree.splits[i].idx2  << std::endl;
+		}
+		telemetry.add_time(TrainingTelemetry::SPLIT_SEARCH, start);
+
+		start = TrainingTelemetry::now();
+		#pragma omp parallel for schedule(dynamic) if (node_parallel)
+		for (long n = 0; n < count; ++n)
+		{
+			const unsigned long i = first + n;
+			const unsigned long mid = partition_samples(tree.splits[i], samples, parts[i].first, parts[i].second, true);
+
+			parts[left_child(i)] = std::make_pair(parts[i].first, mid);
+			parts[right_child(i)] = std::make_pair(mid, parts[i].second);
+		}
+		telemetry.add_time(TrainingTelemetry::PARTITIONING, start);
+	}
+
+	// Now all the parts contain the ranges for the leaves so we can use them to
+	// compute the average leaf values. The same pass applies the leaves to the
+	// current shapes and sums the new residuals of each leaf, which are added
+	// in leaf order to get the same root sum regardless of the threads.
+	const double start = TrainingTelemetry::now();
+	const long num_leaves = num_split_nodes + 1;
+	tree.leaf_values.resize(num_leaves);
+	std::vector<double> leaf_residuals(num_leaves * dims, 0.0);
+	#pragma omp parallel for schedule(dynamic)
+	for (long i = 0; i < num_leaves; ++i)
+	{
+		const std::pair<unsigned long, unsigned long> &range = parts[num_split_nodes+i];
+		tree.leaf_values[i] = cv::Mat::zeros(rows, cols, CV_64F);
+		double *leaf = tree.leaf_values[i].ptr<double>();
+		if (range.second != range.first)
+		{
+			const double *sum = sums[num_split_nodes+i].ptr<double>();
+			const double scale = get_nu() / (range.second - range.first);
+			for (int k = 0; k < dims; ++k)
+				leaf[k] = sum[k] * scale;
+		}
+
+		// now adjust the current shape based on these predictions
+		double *residual = &leaf_residuals[i * dims];
+		for (unsigned long j = range.first; j < range.second; ++j)
+		{
+			const double *target = samples[j].target_shape.ptr<double>();
+			double *current = samples[j].current_shape.ptr<double>();
+			for (int k = 0; k < dims; ++k)
+			{
+				current[k] += leaf[k];
+				residual[k] += target[k] - current[k];
+			}
+		}
+	}
+
+	// the samples left out of the tree are also updated with its predictions
+	#pragma omp parallel for schedule(static)
+	for (long j = num_tree_samples; j < (long) num_samples; ++j)
+	{
+		const double *leaf = tree(samples[j].feature_pixel_values).ptr<double>();
+		double *current = samples[j].current_shape.ptr<double>();
+		for (int k = 0; k < dims; ++k)
+			current[k] += leaf[k];
+	}
+
+	// the next tree draws other samples in that case, so the sum is useless
+	if (num_tree_samples == num_samples)
+	{
+		residual_sum = cv::Mat::zeros(rows, cols, CV_64F);
+		double *total = residual_sum.ptr<double>();
+		for (long i = 0; i < num_leaves; ++i)
+			for (int k = 0; k < dims; ++k)
+				total[k] += leaf_residuals[i * dims + k];
+	}
+	else
+		residual_sum.release();
+	telemetry.add_time(TrainingTelemetry::LEAF_UPDATE, start);
+//std::cout << "newer samples[" << 0 << "].current_shape = " << samples[0].current_shape << std::endl;
+//std::getchar();
+	return tree;
+}
+
+size_t ShapePredictorTrainer::compute_shared_tree_size (
+	unsigned long num_parts
+) const
+{
+	// every process has one slot (a shape sum and a count) for each candidate
+	// split of each node of a tree level, and the coordinator publishes the
+	// chosen splits and the leaf values
+	const unsigned long slot = 2 * num_parts + 1;
+	const unsigned long num_leaves = 1UL << get_tree_depth();
+	const unsigned long level_nodes = std::max(1UL, num_leaves / 2);
+	const unsigned long rank_block = std::max(level_nodes * get_num_test_splits(), num_leaves) * slot;
+	return sizeof(double) * (get_num_processes() * rank_block + level_nodes * 3 + num_leaves * (slot - 1));
+}
+
+
+RegressionTree ShapePredictorTrainer::make_shared_regression_tree (
+	std::vector<TrainingSample>& samples,
+	unsigned long begin,
+	unsigned long end,
+	const AliasTable& pixel_pairs,
+	unsigned long cascade,
+	unsigned long tree_index,
+	ProcessGroup &group,
+	TrainingTelemetry &telemetry
+) const
+{
+	// Each process computes the statistics of the candidate splits using its
+	// own samples (those in [begin, end)). The coordinator adds them up,
+	// chooses the splits and computes the leaf values; every process then
+	// applies them to its samples. Only the coordinator keeps the node sums.
+	const uint64_t seed = RandomStream::hash_seed(get_random_seed());
+	const int rank = group.get_rank();
+	const unsigned long rows = samples[0].target_shape.rows;
+	const unsigned long cols = samples[0].target_shape.cols;
+	const unsigned long shape_size = rows * cols;
+	const unsigned long slot = shape_size + 1;
+	const unsigned long num_split_nodes = static_cast<unsigned long>(std::pow(2.0, (double)get_tree_depth())-1);
+	const unsigned long num_leaves = num_split_nodes + 1;
+	const unsigned long level_nodes = std::max(1UL, num_leaves / 2);
+	const unsigned long rank_block = std::max(level_nodes * get_num_test_splits(), num_leaves) * slot;
+
+	double *shared = (double*) group.get_shared();
+	double *local = shared + rank * rank_block;
+	double *chosen = shared + group.get_size() * rank_block;
+	double *leaves = chosen + level_nodes * 3;
+
+	std::vector<std::pair<unsigned long, unsigned long> > parts(num_split_nodes*2+1);
+	parts[0] = std::make_pair(begin, end);
+	std::vector<cv::Mat> sums;
+	std::vector<unsigned long> counts;
+
+	RegressionTree tree;
+	tree.splits.resize(num_split_nodes);
+
+	// the sum of the residuals of the root node
+	double start = TrainingTelemetry::now();
+	{
+		cv::Mat sum(rows, cols, CV_64F, local);
+		sum = cv::Scalar(0);
+		for (unsigned long j = begin; j < end; ++j)
+			sum += samples[j].target_shape - samples[j].current_shape;
+		local[shape_size] = (double) (end - begin);
+	}
+	group.barrier();
+	if (rank == 0)
+	{
+		sums.resize(num_split_nodes*2+1);
+		counts.resize(num_split_nodes*2+1);
+		sums[0] = cv::Mat::zeros(rows, cols, CV_64F);
+		for (int r = 0; r < group.get_size(); ++r)
+		{
+			const double *other = shared + r * rank_block;
+			sums[0] += cv::Mat(rows, cols, CV_64F, (void*) other);
+			counts[0] += (unsigned long) other[shape_size];
+		}
+	}
+	group.barrier();
+	telemetry.add_time(TrainingTelemetry::SPLIT_SEARCH, start);
+
+	Mat temp;
+	for (unsigned long depth = 0; depth < get_tree_depth(); ++depth)
+	{
+		const unsigned long first = (1UL << depth) - 1;
+		const unsigned long count = 1UL << depth;
+
+		// the statistics of every candidate split of the level
+		start = TrainingTelemetry::now();
+		std::fill(local, local + count * get_num_test_splits() * slot, 0.0);
+		for (unsigned long n = 0; n < count; ++n)
+		{
+			const unsigned long i = first + n;
+			RandomStream rnd(seed, RandomStream::SPLITS, cascade, tree_index, i);
+			std::vector<SplitFeature> feats;
+			feats.reserve(get_num_test_splits());
+			for (unsigned long k = 0; k < get_num_test_splits(); ++k)
+				feats.push_back(randomly_generate_split_feature(pixel_pairs, rnd));
+
+			for (unsigned long j = parts[i].first; j < parts[i].second; ++j)
+			{
+				const TrainingSample &sample = samples[j];
+				temp = sample.target_shape - sample.current_shape;
+				for (unsigned long k = 0; k < feats.size(); ++k)
+				{
+					if (sample.feature_pixel_values[feats[k].idx1] - sample.feature_pixel_values[feats[k].idx2] > feats[k].thresh)
+					{
+						cv::Mat left_sum(rows, cols, CV_64F, local + (n * feats.size() + k) * slot);
+						left_sum += temp;
+						local[(n * feats.size() + k) * slot + shape_size] += 1;
+					}
+				}
+			}
+		}
+		group.barrier();
+
+		// the coordinator chooses the best split of each node, in the same way
+		// as 'find_best_split'
+		if (rank == 0)
+		{
+			for (unsigned long n = 0; n < count; ++n)
+			{
+				const unsigned long i = first + n;
+				RandomStream rnd(seed, RandomStream::SPLITS, cascade, tree_index, i);
+				std::vector<SplitFeature> feats;
+				for (unsigned long k = 0; k < get_num_test_splits(); ++k)
+					feats.push_back(randomly_generate_split_feature(pixel_pairs, rnd));
+
+				std::vector<cv::Mat> left_sums(feats.size());
+				std::vector<unsigned long> left_cnt(feats.size());
+				for (unsigned long k = 0; k < feats.size(); ++k)
+				{
+					left_sums[k] = cv::Mat::zeros(rows, cols, CV_64F);
+					for (int r = 0; r < group.get_size(); ++r)
+					{
+						const double *other = shared + r * rank_block + (n * feats.size() + k) * slot;
+						left_sums[k] += cv::Mat(rows, cols, CV_64F, (void*) other);
+						left_cnt[k] += (unsigned long) other[shape_size];
+					}
+				}
+
+				double best_score = -1;
+				unsigned long best_feat = 0;
+				for (unsigned long k = 0; k < feats.size(); ++k)
+				{
+					const unsigned long right_cnt = counts[i] - left_cnt[k];
+					if (left_cnt[k] != 0 && right_cnt != 0)
+					{
+						temp = sums[i] - left_sums[k];
+						const double score = left_sums[k].dot(left_sums[k])/left_cnt[k] + temp.dot(temp)/right_cnt;
+						if (score > best_score)
+						{
+							best_score = score;
+							best_feat = k;
+						}
+					}
+				}
+
+				sums[left_child(i)] = left_sums[best_feat];
+				sums[right_child(i)] = sums[i] - left_sums[best_feat];
+				counts[left_child(i)] = left_cnt[best_feat];
+				counts[right_child(i)] = counts[i] - left_cnt[best_feat];
+				chosen[n * 3 + 0] = feats[best_feat].idx1;
+				chosen[n * 3 + 1] = feats[best_feat].idx2;
+				chosen[n * 3 + 2] = feats[best_feat].thresh;
+			}
+		}
+		group.barrier();
+		telemetry.add_time(TrainingTelemetry::SPLIT_SEARCH, start);
+
+		start = TrainingTelemetry::now();
+		for (unsigned long n = 0; n < count; ++n)
+		{
+			const unsigned long i = first + n;
+			tree.splits[i].idx1 = (uint16_t) chosen[n * 3 + 0];
+			tree.splits[i].idx2 = (uint16_t) chosen[n * 3 + 1];
+			tree.splits[i].thresh = (float) chosen[n * 3 + 2];
+
+			const unsigned long mid = partition_samples(tree.splits[i], samples, parts[i].first, parts[i].second, false);
+			parts[left_child(i)] = std::make_pair(parts[i].first, mid);
+			parts[right_child(i)] = std::make_pair(mid, parts[i].second);
+		}
+		telemetry.add_time(TrainingTelemetry::PARTITIONING, start);
+	}
+
+	// the coordinator publishes the leaf values and every process updates the
+	// current shapes of its samples
+	start = TrainingTelemetry::now();
+	if (rank == 0)
+	{
+		for (unsigned long i = 0; i < num_leaves; ++i)
+		{
+			cv::Mat value(rows, cols, CV_64F, leaves + i * shape_size);
+			const unsigned long node = num_split_nodes + i;
+			if (counts[node] != 0)
+				cv::Mat(sums[node] * get_nu() / counts[node]).copyTo(value);
+			else
+				value = cv::Scalar(0);
+		}
+	}
+	group.barrier();
+
+	tree.leaf_values.resize(num_leaves);
+	for (unsigned long i = 0; i < num_leaves; ++i)
+	{
+		cv::Mat(rows, cols, CV_64F, leaves + i * shape_size).copyTo(tree.leaf_values[i]);
+
+		const std::pair<unsigned long, unsigned long> &range = parts[num_split_nodes+i];
+		for (unsigned long j = range.first; j < range.second; ++j)
+			samples[j].current_shape += tree.leaf_values[i];
+	}
+	// nobody may change the shared data while the other processes read it
+	group.barrier();
+	telemetry.add_time(TrainingTelemetry::LEAF_UPDATE, start);
+
+	return tree;
+}
+
+
+/**
+ * Create an split feature with randomly generated threshold.
+ */
+SplitFeature ShapePredictorTrainer::randomly_generate_split_feature (
+	const AliasTable& pixel_pairs,
+	RandomStream &rnd
+) const
+{
+	// the table entries are the ordered pairs of distinct pixels (see
+	// 'compute_pixel_pair_weights')
+	const unsigned long pool_size = get_feature_pool_size();
+	const unsigned long pair = pixel_pairs.sample(rnd);
+	SplitFeature feat;
+	feat.idx1 = pair / (pool_size - 1);
+	feat.idx2 = pair % (pool_size - 1);
+	if (feat.idx2 >= feat.idx1) ++feat.idx2;
+
+	feat.thresh = (rnd.get_random_double()*256 - 128)/2.0;
+
+	return feat;
+}
+
+
+std::vector<double> ShapePredictorTrainer::compute_pixel_pair_weights (
+	const std::vector<cv::Point2f >& pixel_coordinates
+) const
+{
+	// Each ordered pair (i,j) with i != j gets the weight exp(-dist/lambda), which
+	// is the distribution the split features were drawn from with rejection
+	// sampling. The distances are offset by the smallest one so the weights do
+	// not underflow with small lambdas (this does not change the distribution).
+	const long pool_size = (long) pixel_coordinates.size();
+	std::vector<double> weights(pool_size * (pool_size - 1));
+
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < pool_size; ++i)
+	{
+		for (long j = 0, k = i * (pool_size - 1); j < pool_size; ++j)
+		{
+			if (i == j) continue;
+			weights[k++] = length(pixel_coordinates[i] - pixel_coordinates[j]);
+		}
+	}
+
+	const double min_dist = *std::min_element(weights.begin(), weights.end());
+	const double lambda = get_lambda();
+	#pragma omp parallel for schedule(static)
+	for (long k = 0; k < (long) weights.size(); ++k)
+		weights[k] = std::exp(-(weights[k] - min_dist) / lambda);
+
+	return weights;
+}
+
+
+/**
+ * Test the given random splits and return the best one.
+ */
+SplitFeature ShapePredictorTrainer::generate_split (
+	const std::vector<TrainingSample>& samples,
+	unsigned long begin,
+	unsigned long end,
+	const std::vector<unsigned long>& subset,
+	const std::vector<SplitFeature>& feats,
+	const cv::Mat& sum,
+	cv::Mat& left_sum,
+	cv::Mat& right_sum,
+	bool parallel
+) const
+{
+	// The splits are tested with all samples of the node or only with the
+	// samples in 'subset'. In the latter case we need the sum of the subset.
+	cv::Mat subset_sum = sum;
+	if (!subset.empty())
+	{
+		subset_sum = cv::Mat::zeros(sum.rows, sum.cols, sum.type());
+		for (size_t k = 0; k < subset.size(); ++k)
+			subset_sum += samples[subset[k]].target_shape - samples[subset[k]].current_shape;
+	}
+
+	SplitFeature split;
+	if (get_split_strategy() == SPLIT_HISTOGRAM)
+		split = find_best_histogram_split(samples, begin, end, subset, feats, subset_sum, left_sum, parallel);
+	else
+		split = find_best_split(samples, begin, end, subset, feats, subset_sum, left_sum, parallel);
+
+	// The sums of the child nodes must include every sample of the node. They
+	// are accumulated in fixed size chunks added up in order, like the split
+	// search, so the result does not change with the number of threads.
+	if (!subset.empty())
+	{
+		const int dims = sum.rows * sum.cols;
+		const long num_chunks = (end - begin + SPLIT_CHUNK_SIZE - 1) / SPLIT_CHUNK_SIZE;
+		std::vector<double> chunk_sums(num_chunks * dims, 0.0);
+
+		#pragma omp parallel for schedule(dynamic) if (parallel && num_chunks > 1)
+		for (long c = 0; c < num_chunks; ++c)
+		{
+			double *output = &chunk_sums[c * dims];
+			const unsigned long first = begin + c * SPLIT_CHUNK_SIZE;
+			const unsigned long last = std::min(first + SPLIT_CHUNK_SIZE, end);
+			for (unsigned long j = first; j < last; ++j)
+			{
+				const TrainingSample &sample = samples[j];
+				if (sample.feature_pixel_values[split.idx1] - sample.feature_pixel_values[split.idx2] > split.thresh)
+				{
+					const double *target = sample.target_shape.ptr<double>();
+					const double *current = sample.current_shape.ptr<double>();
+					for (int d = 0; d < dims; ++d)
+						output[d] += target[d] - current[d];
+				}
+			}
+		}
+
+		left_sum = cv::Mat::zeros(sum.rows, sum.cols, CV_64F);
+		double *left = left_sum.ptr<double>();
+		for (long c = 0; c < num_chunks; ++c)
+		{
+			const double *input = &chunk_sums[c * dims];
+			for (int d = 0; d < dims; ++d)
+				left[d] += input[d];
+		}
+	}
+
+	right_sum = cv::Mat(sum - left_sum);
+	return split;
+}
+
+
+/**
+ * Test the given random splits (with their thresholds) and return the best one.
+ */
+SplitFeature ShapePredictorTrainer::find_best_split (
+	const std::vector<TrainingSample>& samples,
+	unsigned long begin,
+	unsigned long end,
+	const std::vector<unsigned long>& subset,
+	const std::vector<SplitFeature>& feats,
+	const cv::Mat& sum,
+	cv::Mat& left_sum,
+	bool parallel
+) const
+{
+	const unsigned long num_test_splits = feats.size();
+	const unsigned long count = (subset.empty()) ? end - begin : subset.size();
+
+	// The sums of vectors that go left for each feature are computed for fixed
+	// size chunks of samples and then added up in order. That way the result
+	// does not change with the number of threads.
+	const long num_chunks = (count + SPLIT_CHUNK_SIZE - 1) / SPLIT_CHUNK_SIZE;
+	std::vector<std::vector<cv::Mat> > chunk_sums(num_chunks);
+	std::vector<std::vector<unsigned long> > chunk_cnt(num_chunks);
+
+	#pragma omp parallel for schedule(dynamic) if (parallel && num_chunks > 1)
+	for (long c = 0; c < num_chunks; ++c)
+	{
+		std::vector<cv::Mat> &left_sums = chunk_sums[c];
+		std::vector<unsigned long> &left_cnt = chunk_cnt[c];
+		left_sums.resize(num_test_splits);
+		left_cnt.resize(num_test_splits);
+
+		const unsigned long first = c * SPLIT_CHUNK_SIZE;
+		const unsigned long last = std::min(first + SPLIT_CHUNK_SIZE, count);
+
+		Mat temp;
+		for (unsigned long k = first; k < last; ++k)
+		{
+			const TrainingSample &sample = (subset.empty()) ? samples[begin + k] : samples[subset[k]];
+			temp = sample.target_shape-sample.current_shape;
+			for (unsigned long i = 0; i < num_test_splits; ++i)
+			{
+				if (sample.feature_pixel_values[feats[i].idx1] - sample.feature_pixel_values[feats[i].idx2] > feats[i].thresh)
+				{
+					if (left_sums[i].rows == 0)
+						temp.copyTo(left_sums[i]);
+					else
+						left_sums[i] += temp;
+					++left_cnt[i];
+				}
+			}
+		}
+	}
+
+	std::vector<cv::Mat > left_sums(num_test_splits);
+	std::vector<unsigned long> left_cnt(num_test_splits);
+	for (long c = 0; c < num_chunks; ++c)
+	{
+		for (unsigned long i = 0; i < num_test_splits; ++i)
+		{
+			if (chunk_sums[c][i].rows == 0) continue;
+			if (left_sums[i].rows == 0)
+				left_sums[i] = chunk_sums[c][i];
+			else
+				left_sums[i] += chunk_sums[c][i];
+			left_cnt[i] += chunk_cnt[c][i];
+		}
+	}
+
+	// now figure out which feature is the best
+	double best_score = -1;
+	unsigned long best_feat = 0;
+	Mat temp;
 	for (unsigned long i = 0; i < num_test_splits; ++i)
 	{
 		// check how well the feature splits the space.
 		double score = 0;
-		unsigned long right_cnt = end-begin-left_cnt[i];
+		unsigned long right_cnt = count-left_cnt[i];
 		if (left_cnt[i] != 0 && right_cnt != 0)
 		{
 			temp = sum - left_sums[i];
@@ -690,20 +2353,130 @@ SplitFeature ShapePredictorTrainer::generate_split (
 		}
 	}
 
-	cv::swap(left_sums[best_feat], left_sum);
-	//if (left_sum.size() != 0)
-	if (left_sum.rows != 0)
+	if (left_sums[best_feat].rows != 0)
+		cv::swap(left_sums[best_feat], left_sum);
+	else
+		left_sum = cv::Mat::zeros(sum.rows, sum.cols, sum.type());
+	return feats[best_feat];
+}
+
+
+/**
+ * For each one of the given pixel pairs, build an histogram of the pixel
+ * differences and find the best threshold. Returns the best pair with its
+ * threshold.
+ */
+SplitFeature ShapePredictorTrainer::find_best_histogram_split (
+	const std::vector<TrainingSample>& samples,
+	unsigned long begin,
+	unsigned long end,
+	const std::vector<unsigned long>& subset,
+	const std::vector<SplitFeature>& feats,
+	const cv::Mat& sum,
+	cv::Mat& left_sum,
+	bool parallel
+) const
+{
+	assert(sum.type() == CV_64F && sum.isContinuous());
+
+	const long num_test_splits = feats.size();
+	const int dims = sum.rows * sum.cols;
+	const double *total = sum.ptr<double>();
+	const unsigned long count = (subset.empty()) ? end - begin : subset.size();
+
+	// the best threshold and its score for each feature
+	std::vector<SplitFeature> best_feats(feats);
+	std::vector<double> best_scores(num_test_splits, -1);
+	std::vector<cv::Mat> best_left_sums(num_test_splits);
+
+	#pragma omp parallel if (parallel && num_test_splits > 1)
 	{
-		right_sum = cv::Mat(sum - left_sum);
+		std::vector<unsigned long> bin_cnt(HISTOGRAM_BINS);
+		std::vector<double> bin_sums(HISTOGRAM_BINS * dims);
+		std::vector<double> left(dims);
+
+		#pragma omp for schedule(dynamic)
+		for (long i = 0; i < num_test_splits; ++i)
+		{
+			std::fill(bin_cnt.begin(), bin_cnt.end(), 0);
+			std::fill(bin_sums.begin(), bin_sums.end(), 0.0);
+
+			// accumulate the residuals of each pixel difference in one pass
+			for (unsigned long k = 0; k < count; ++k)
+			{
+				const TrainingSample &sample = (subset.empty()) ? samples[begin + k] : samples[subset[k]];
+				const int diff = (int) (sample.feature_pixel_values[feats[i].idx1] - sample.feature_pixel_values[feats[i].idx2]);
+				const int bin = std::min(std::max(diff + 255, 0), HISTOGRAM_BINS - 1);
+				const double *target = sample.target_shape.ptr<double>();
+				const double *current = sample.current_shape.ptr<double>();
+				double *output = &bin_sums[bin * dims];
+				for (int d = 0; d < dims; ++d)
+					output[d] += target[d] - current[d];
+				++bin_cnt[bin];
+			}
+
+			// Samples go left when the difference is greater than the threshold,
+			// so we move the threshold down one bin at a time and test it right
+			// below every non-empty bin.
+			std::fill(left.begin(), left.end(), 0.0);
+			unsigned long left_cnt = 0;
+			int best_bin = -1;
+			for (int bin = HISTOGRAM_BINS - 1; bin > 0; --bin)
+			{
+				if (bin_cnt[bin] == 0) continue;
+
+				const double *input = &bin_sums[bin * dims];
+				for (int d = 0; d < dims; ++d)
+					left[d] += input[d];
+				left_cnt += bin_cnt[bin];
+
+				const unsigned long right_cnt = count - left_cnt;
+				if (right_cnt == 0) break;
+
+				double left_dot = 0, right_dot = 0;
+				for (int d = 0; d < dims; ++d)
+				{
+					const double right = total[d] - left[d];
+					left_dot += left[d] * left[d];
+					right_dot += right * right;
+				}
+				const double score = left_dot / left_cnt + right_dot / right_cnt;
+				if (score > best_scores[i])
+				{
+					best_scores[i] = score;
+					best_bin = bin;
+					cv::Mat(sum.rows, sum.cols, CV_64F, &left[0]).copyTo(best_left_sums[i]);
+				}
+			}
+
+			if (best_bin >= 0)
+				best_feats[i].thresh = (best_bin - 255) - 0.5f;
+		}
 	}
-	else
+
+	// now figure out which feature is the best
+	double best_score = -1;
+	long best_feat = -1;
+	for (long i = 0; i < num_test_splits; ++i)
+	{
+		if (best_scores[i] > best_score)
+		{
+			best_score = best_scores[i];
+			best_feat = i;
+		}
+	}
+
+	if (best_feat < 0)
 	{
-		//right_sum = sum;
-		sum.copyTo(right_sum);
+		// no feature split the samples; send all of them to the right
+		SplitFeature feat = feats[0];
+		feat.thresh = 256;
 		left_sum = cv::Mat::zeros(sum.rows, sum.cols, sum.type());
+		return feat;
 	}
-	return feats[best_feat];
-	//return impl::SplitFeature();
+
+	cv::swap(best_left_sums[best_feat], left_sum);
+	return best_feats[best_feat];
 }
 
 /**
@@ -715,7 +2488,8 @@ unsigned long ShapePredictorTrainer::partition_samples (
 	const SplitFeature& split,
 	std::vector<TrainingSample>& samples,
 	unsigned long begin,
-	unsigned long end
+	unsigned long end,
+	bool move_contents
 ) const
 {
 	//
@@ -726,7 +2500,12 @@ unsigned long ShapePredictorTrainer::partition_samples (
 //std::cout << samples[j].feature_pixel_values[split.idx1] << " - " << samples[j].feature_pixel_values[split.idx2] << "> " << split.thresh << std::endl;
 		if (samples[j].feature_pixel_values[split.idx1] - samples[j].feature_pixel_values[split.idx2] > split.thresh)
 		{
-			samples[i].swap(samples[j]);
+			if (move_contents)
+			{
+				if (i != j) samples[i].swap_contents(samples[j], get_feature_pool_size());
+			}
+			else
+				samples[i].swap(samples[j]);
 			++i;
 		}
 	}
@@ -738,22 +2517,39 @@ unsigned long ShapePredictorTrainer::partition_samples (
 
 cv::Mat ShapePredictorTrainer::populate_training_sample_shapes(
 	const std::vector<std::vector<ObjectDetection*> >& objects,
-	std::vector<TrainingSample>& samples
+	std::vector<TrainingSample>& samples,
+	SampleStorage &storage
 ) const
 {
 	samples.clear();
 	cv::Mat mean_shape;
-	long count = 0;
 
-	// first fill out the target shapes
+	// The target shapes never change, so they are stored once in a single
+	// matrix (two rows per object) and the oversampled copies of each object
+	// reference the same rows.
+	unsigned long num_objects = 0, num_parts = 0;
 	for (unsigned long i = 0; i < objects.size(); ++i)
 	{
 		for (unsigned long j = 0; j < objects[i].size(); ++j)
+		{
+			num_parts = objects[i][j]->num_parts();
+			++num_objects;
+		}
+	}
+	cv::Mat target_shapes(2 * num_objects, num_parts, CV_64F);
+
+	// first fill out the target shapes
+	samples.reserve(num_objects * get_oversampling_amount());
+	unsigned long count = 0;
+	for (unsigned long i = 0; i < objects.size(); ++i)
+	{
+		for (unsigned long j = 0; j < objects[i].size(); ++j, ++count)
 		{
 			TrainingSample sample;
 			sample.image_idx = i;
 			sample.rect = objects[i][j]->get_rect();
-			sample.target_shape = object_to_shape(*objects[i][j]);
+			sample.target_shape = target_shapes.rowRange(2 * count, 2 * count + 2);
+			object_to_shape(*objects[i][j]).copyTo(sample.target_shape);
 
 			for (unsigned long itr = 0; itr < get_oversampling_amount(); ++itr)
 				samples.push_back(sample);
@@ -763,17 +2559,22 @@ cv::Mat ShapePredictorTrainer::populate_training_sample_shapes(
 				sample.target_shape.copyTo(mean_shape);
 			else
 				mean_shape += sample.target_shape;
-			++count;
 		}
 	}
 
 	// compute the mean shape
-	mean_shape /= count;
+	mean_shape /= (double) count;
+
+	// The current shapes are also kept in a single buffer, allocated once and
+	// filled in parallel below.
+	allocate_current_shapes(samples, storage);
 
 	// now go pick random initial shapes
-	for (unsigned long i = 0; i < samples.size(); ++i)
+	const uint64_t seed = RandomStream::hash_seed(get_random_seed());
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < (long) samples.size(); ++i)
 	{
-		if (false || (i%get_oversampling_amount()) == 0)
+		if ((i%get_oversampling_amount()) == 0)
 		{
 			// The mean shape is what we really use as an initial shape so always
 			// include it in the training set as an example starting shape.
@@ -783,19 +2584,15 @@ cv::Mat ShapePredictorTrainer::populate_training_sample_shapes(
 		{
 			// Pick a random convex combination of two of the target shapes and use
 			// that as the initial shape for this sample.
-			const unsigned long rand_idx = rnd->get_random_32bit_number() % samples.size();
-			const unsigned long rand_idx2 = rnd->get_random_32bit_number() % samples.size();
-			const double alpha = rnd->get_random_double();
-			samples[i].current_shape = alpha*samples[rand_idx].target_shape + (1-alpha)*samples[rand_idx2].target_shape;
-//std::cout << mean_shape << std::endl;
-//std::cout << samples[i].current_shape << std::endl;
-//std::getchar();
+			RandomStream rnd(seed, RandomStream::INITIAL_SHAPES, i);
+			const unsigned long rand_idx = rnd.get_random_32bit_number() % samples.size();
+			const unsigned long rand_idx2 = rnd.get_random_32bit_number() % samples.size();
+			const double alpha = rnd.get_random_double();
+			cv::addWeighted(samples[rand_idx].target_shape, alpha, samples[rand_idx2].target_shape,
+				1 - alpha, 0, samples[i].current_shape);
 		}
 	}
 
-//std::cout << mean_shape << std::endl;
-//std::getchar();
-
 	return mean_shape;
 }
 
@@ -805,7 +2602,8 @@ void ShapePredictorTrainer::randomly_sample_pixel_coordinates (
 	const double min_x,
 	const double min_y,
 	const double max_x,
-	const double max_y
+	const double max_y,
+	RandomStream &rnd
 ) const
 /*!
 	ensures
@@ -817,8 +2615,8 @@ void ShapePredictorTrainer::randomly_sample_pixel_coordinates (
 	pixel_coordinates.resize(get_feature_pool_size());
 	for (unsigned long i = 0; i < get_feature_pool_size(); ++i)
 	{
-		pixel_coordinates[i].x = rnd->get_random_double()*(max_x-min_x) + min_x;
-		pixel_coordinates[i].y = rnd->get_random_double()*(max_y-min_y) + min_y;
+		pixel_coordinates[i].x = rnd.get_random_double()*(max_x-min_x) + min_x;
+		pixel_coordinates[i].y = rnd.get_random_double()*(max_y-min_y) + min_y;
 //std::cout << "pixel_coordinates[" << i << "] = " << pixel_coordinates[i] << std::endl;
 //std::getchar();
 	}
@@ -845,10 +2643,14 @@ std::vector<std::vector<cv::Point2f > > ShapePredictorTrainer::randomly_sample_p
 //std::cout << "randomly_sample_pixel_coordinates: " << min_x << "  " << min_y << "  " << max_y << "  " << max_y << std::endl;
 //std::getchar();
 
+	const uint64_t seed = RandomStream::hash_seed(get_random_seed());
 	std::vector<std::vector<cv::Point2f > > pixel_coordinates;
 	pixel_coordinates.resize(get_cascade_depth());
 	for (unsigned long i = 0; i < get_cascade_depth(); ++i)
-		randomly_sample_pixel_coordinates(pixel_coordinates[i], min_x, min_y, max_x, max_y);
+	{
+		RandomStream rnd(seed, RandomStream::PIXEL_COORDINATES, i);
+		randomly_sample_pixel_coordinates(pixel_coordinates[i], min_x, min_y, max_x, max_y, rnd);
+	}
 	return pixel_coordinates;
 }
 
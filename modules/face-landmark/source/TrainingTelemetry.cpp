@@ -0,0 +1,133 @@
+#include "TrainingTelemetry.hh"
+#include <opencv2/opencv.hpp>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+
+namespace ert {
+
+
+static const char *PHASE_NAMES[] =
+{
+	"feature_extraction",
+	"split_search",
+	"partitioning",
+	"leaf_update",
+	"validation",
+	"checkpoint"
+};
+
+
+TrainingTelemetry::TrainingTelemetry(
+	const std::string &fileName,
+	bool append )
+{
+	if (!fileName.empty())
+	{
+		out.open(fileName.c_str(), (append) ? std::ios::app : std::ios::out);
+		if (!out.good())
+			throw std::runtime_error("Unable to create the telemetry file " + fileName);
+	}
+	for (int i = 0; i < NUM_PHASES; ++i)
+		phases[i] = totals[i] = 0;
+	trainingStart = cascadeStart = now();
+}
+
+
+double TrainingTelemetry::now()
+{
+	return (double) cv::getTickCount() / cv::getTickFrequency();
+}
+
+
+long TrainingTelemetry::peak_memory()
+{
+#if defined(__unix__) || defined(__APPLE__)
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+	#ifdef __APPLE__
+	// macOS reports bytes
+	return usage.ru_maxrss / 1024;
+	#else
+	return usage.ru_maxrss;
+	#endif
+#else
+	return 0;
+#endif
+}
+
+
+void TrainingTelemetry::add_time(
+	Phase phase,
+	double start )
+{
+	phases[phase] += now() - start;
+}
+
+
+void TrainingTelemetry::begin_cascade()
+{
+	for (int i = 0; i < NUM_PHASES; ++i)
+		phases[i] = 0;
+	cascadeStart = now();
+}
+
+
+void TrainingTelemetry::write_phases(
+	const double *values,
+	double elapsed )
+{
+	double other = elapsed;
+	out << "\"phases\":{";
+	for (int i = 0; i < NUM_PHASES; ++i)
+	{
+		out << "\"" << PHASE_NAMES[i] << "\":" << values[i] << ",";
+		other -= values[i];
+	}
+	out << "\"other\":" << ((other > 0) ? other : 0) << "}";
+}
+
+
+void TrainingTelemetry::end_cascade(
+	unsigned long cascade,
+	unsigned long trees,
+	unsigned long samples,
+	double training_error,
+	double validation_error )
+{
+	const double elapsed = now() - cascadeStart;
+	for (int i = 0; i < NUM_PHASES; ++i)
+		totals[i] += phases[i];
+	if (!out.is_open()) return;
+
+	out << "{\"event\":\"cascade\",\"cascade\":" << cascade << ",\"trees\":" << trees <<
+		",\"samples\":" << samples << ",\"seconds\":" << elapsed << ",";
+	write_phases(phases, elapsed);
+	out << ",\"trees_per_second\":" << ((elapsed > 0) ? trees / elapsed : 0) <<
+		",\"samples_per_second\":" << ((elapsed > 0) ? (double) trees * samples / elapsed : 0) <<
+		",\"training_error\":" << training_error;
+	if (validation_error >= 0)
+		out << ",\"validation_error\":" << validation_error;
+	out << ",\"peak_rss_kb\":" << peak_memory() << "}" << std::endl;
+}
+
+
+void TrainingTelemetry::finish(
+	unsigned long trees,
+	unsigned long samples )
+{
+	if (!out.is_open()) return;
+
+	const double elapsed = now() - trainingStart;
+	out << "{\"event\":\"finished\",\"trees\":" << trees << ",\"samples\":" << samples <<
+		",\"seconds\":" << elapsed << ",";
+	write_phases(totals, elapsed);
+	out << ",\"trees_per_second\":" << ((elapsed > 0) ? trees / elapsed : 0) <<
+		",\"peak_rss_kb\":" << peak_memory() << "}" << std::endl;
+}
+
+
+}
@@ -0,0 +1,99 @@
+#ifndef FA_LANDMARK_ERT_TRAINING_TELEMETRY_HH
+#define FA_LANDMARK_ERT_TRAINING_TELEMETRY_HH
+
+#include <string>
+#include <fstream>
+
+namespace ert
+{
+
+
+/**
+ * Collects the time spent in each training phase and writes one JSON line per
+ * cascade level.
+ *
+ *     TrainingTelemetry telemetry("telemetry.json");
+ *     double start = TrainingTelemetry::now();
+ *     long_running_operation();
+ *     telemetry.add_time(TrainingTelemetry::SPLIT_SEARCH, start);
+ *
+ * With an empty file name the times are still collected, but nothing is
+ * written. The methods must be called from the thread driving the training.
+ */
+class TrainingTelemetry
+{
+	public:
+		enum Phase
+		{
+			FEATURE_EXTRACTION,
+			SPLIT_SEARCH,
+			PARTITIONING,
+			LEAF_UPDATE,
+			VALIDATION,
+			CHECKPOINT,
+			NUM_PHASES
+		};
+
+		/**
+		 * Writes the figures to the given file (if any). With 'append' the
+		 * figures are added to the end of the file, e.g. when the training
+		 * resumes from a checkpoint.
+		 */
+		explicit TrainingTelemetry(
+			const std::string &fileName,
+			bool append = false );
+
+		/**
+		 * Adds the time elapsed since 'start' (from 'now') to the given phase.
+		 */
+		void add_time(
+			Phase phase,
+			double start );
+
+		void begin_cascade();
+
+		/**
+		 * Writes the figures of the current cascade level. A negative
+		 * validation error means there is no validation set.
+		 */
+		void end_cascade(
+			unsigned long cascade,
+			unsigned long trees,
+			unsigned long samples,
+			double training_error,
+			double validation_error );
+
+		/**
+		 * Writes the figures of the whole training.
+		 */
+		void finish(
+			unsigned long trees,
+			unsigned long samples );
+
+		/**
+		 * Returns the wall time in seconds.
+		 */
+		static double now();
+
+		/**
+		 * Returns the peak resident set size of the process in kilobytes, or
+		 * zero if it is not available.
+		 */
+		static long peak_memory();
+
+	private:
+		std::ofstream out;
+		double trainingStart;
+		double cascadeStart;
+		double phases[NUM_PHASES];
+		double totals[NUM_PHASES];
+
+		void write_phases(
+			const double *values,
+			double elapsed );
+};
+
+
+}
+
+#endif // FA_LANDMARK_ERT_TRAINING_TELEMETRY_HH
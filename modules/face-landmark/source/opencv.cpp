@@ -1,4 +1,8 @@
 #include <ert/opencv.hh>
+// the universal intrinsics are available since OpenCV 3.3
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 3)
+#include <opencv2/core/hal/intrin.hpp>
+#endif
 
 namespace ert {
 
@@ -34,4 +38,76 @@ cv::Point2f operator/(
 }
 
 
+#if CV_SIMD128
+/**
+ * Convert 16 pixels with 'channels' (3 or 4) interleaved channels.
+ */
+static inline void bgr_to_gray_16(
+	const uint8_t *src,
+	uint8_t *dst,
+	int channels )
+{
+	cv::v_uint8x16 b, g, r, a;
+	if (channels == 3)
+		cv::v_load_deinterleave(src, b, g, r);
+	else
+		cv::v_load_deinterleave(src, b, g, r, a);
+
+	// the sums (up to 766) are computed with 16 bits and the products
+	// with 32 bits, like the scalar loop below
+	cv::v_uint16x8 b0, b1, g0, g1, r0, r1;
+	cv::v_expand(b, b0, b1);
+	cv::v_expand(g, g0, g1);
+	cv::v_expand(r, r0, r1);
+	const cv::v_uint16x8 one = cv::v_setall_u16(1);
+	const cv::v_uint16x8 scale = cv::v_setall_u16(21846);
+	cv::v_uint32x4 p0, p1, p2, p3;
+	cv::v_mul_expand(b0 + g0 + r0 + one, scale, p0, p1);
+	cv::v_mul_expand(b1 + g1 + r1 + one, scale, p2, p3);
+	cv::v_uint16x8 gray0 = cv::v_pack(p0 >> 16, p1 >> 16);
+	cv::v_uint16x8 gray1 = cv::v_pack(p2 >> 16, p3 >> 16);
+	cv::v_store(dst, cv::v_pack(gray0, gray1));
+}
+#endif
+
+
+void bgr_to_gray(
+	const cv::Mat &input,
+	cv::Mat &output )
+{
+	CV_Assert(input.depth() == CV_8U);
+	if (input.channels() == 1)
+	{
+		input.copyTo(output);
+		return;
+	}
+	CV_Assert(input.channels() >= 3 && input.data != output.data);
+
+	output.create(input.rows, input.cols, CV_8U);
+	const int channels = input.channels();
+	for (int y = 0; y < input.rows; ++y)
+	{
+		const uint8_t *src = input.ptr<uint8_t>(y);
+		uint8_t *dst = output.ptr<uint8_t>(y);
+		int x = 0;
+#if CV_SIMD128
+		// the common 3 and 4 channel images are converted 16 pixels at a time
+		// and the scalar loop handles the rest of the row
+		if (channels == 3 || channels == 4)
+		{
+			for (; x + 16 <= input.cols; x += 16, src += 16 * channels)
+				bgr_to_gray_16(src, dst + x, channels);
+		}
+#endif
+		// round(s / 3) == (s + 1) / 3 for s in [0, 765], computed in fixed
+		// point with 21846 / 2^16 (exact in this range)
+		for (; x < input.cols; ++x, src += channels)
+		{
+			const unsigned sum = (unsigned) src[0] + src[1] + src[2] + 1;
+			dst[x] = (uint8_t) ((sum * 21846) >> 16);
+		}
+	}
+}
+
+
 }
@@ -0,0 +1,145 @@
+#include <opencv2/opencv.hpp>
+#include <ert/AnnotationFile.hh>
+#include <ert/SampleList.hh>
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <getopt.h>
+
+
+using namespace ert;
+using namespace std;
+
+
+string scriptFileName = "";
+
+string annotationFileName = "";
+
+string listFileName = "";
+
+
+void main_usage()
+{
+    std::cerr << "Usage: tool_annotations -s <script file> -o <annotation file>" << std::endl;
+    std::cerr << "       tool_annotations -l <annotation file>" << std::endl << std::endl;
+    std::cerr << "   -s  Script file with the images whose '.pts' files will be converted." << std::endl;
+    std::cerr << "   -o  Bulk annotation file to create." << std::endl;
+    std::cerr << "   -l  Print the images and the number of parts in the given" << std::endl;
+    std::cerr << "       annotation file." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+
+void main_parseOptions( int argc, char **argv )
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:o:l:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                scriptFileName = string(optarg);
+                break;
+            case 'o':
+                annotationFileName = string(optarg);
+                break;
+            case 'l':
+                listFileName = string(optarg);
+                break;
+            default: /* '?' */
+                main_usage();
+        }
+    }
+    if (listFileName.empty() && (scriptFileName.empty() || annotationFileName.empty()))
+    {
+		main_usage();
+	}
+}
+
+
+/**
+ * Read the image paths of a script file (the first line contains the amount
+ * of images).
+ */
+void main_loadScript(
+	const std::string &fileName,
+	std::vector<std::string> &imageFileNames )
+{
+	std::ifstream script(fileName.c_str());
+	std::string line;
+	int imageCount = 0;
+	if (!std::getline(script, line) || sscanf(line.c_str(), "%d", &imageCount) != 1)
+		throw std::runtime_error("Invalid script file " + fileName);
+
+	imageFileNames.clear();
+	for (int i = 0; i < imageCount && std::getline(script, line); ++i)
+	{
+		std::string imageFileName;
+		uint64_t fileSize;
+		int width, height;
+		SampleList::parseScriptLine(line, imageFileName, fileSize, width, height);
+		imageFileNames.push_back(imageFileName);
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	main_parseOptions(argc, argv);
+
+	try
+	{
+		if (!listFileName.empty())
+		{
+			AnnotationFile annotations(listFileName);
+			ObjectDetection annot;
+			for (size_t i = 0; i < annotations.size(); ++i)
+			{
+				std::string imageFileName = annotations.getImageFileName(i);
+				annotations.find(imageFileName, annot);
+				std::cout << imageFileName << " " << annot.num_parts() << std::endl;
+			}
+			return 0;
+		}
+
+		std::vector<std::string> imageFileNames;
+		main_loadScript(scriptFileName, imageFileNames);
+
+		// the '.pts' files are small, so reading them is dominated by the
+		// file system latency; several threads hide part of it
+		std::vector<ObjectDetection> annotations(imageFileNames.size());
+		#pragma omp parallel for schedule(dynamic, 16)
+		for (long i = 0; i < (long) imageFileNames.size(); ++i)
+			annotations[i].load(SampleList::changeExtension(imageFileNames[i], "pts"));
+
+		// images without annotations are left out
+		size_t count = 0;
+		for (size_t i = 0; i < annotations.size(); ++i)
+		{
+			if (annotations[i].num_parts() == 0)
+			{
+				std::cout << "   Ignoring file " << imageFileNames[i] << std::endl;
+				continue;
+			}
+			imageFileNames[count].swap(imageFileNames[i]);
+			std::swap(annotations[count], annotations[i]);
+			++count;
+		}
+		imageFileNames.resize(count);
+		annotations.resize(count);
+
+		AnnotationFile::save(annotationFileName, imageFileNames, annotations);
+		std::cout << "Saved the annotations of " << count << " images in " << annotationFileName << std::endl;
+	} catch (exception& e)
+	{
+		cout << "Exception thrown!" << endl;
+		cout << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,271 @@
+#include <ert/ObjectDetection.hh>
+#include <ert/SampleList.hh>
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <set>
+#include <cstring>
+#include <cstdio>
+#include <stdexcept>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+
+using namespace ert;
+using namespace std;
+
+
+vector<string> directories;
+
+string outputFileName = "";
+
+int expectedParts = 0;
+
+
+struct IndexEntry
+{
+	string imageFileName;
+	uint64_t size;
+	int width;
+	int height;
+	bool valid;
+};
+
+
+void main_usage()
+{
+    std::cerr << "Usage: tool_index -o <script file> [ -n <parts> ] <directory> [ <directory> ... ]" << std::endl << std::endl;
+    std::cerr << "   -o  Script file to create. Each line has the image path, the file" << std::endl;
+    std::cerr << "       size and the image dimensions (separated by tabs)." << std::endl;
+    std::cerr << "   -n  Only index images whose annotations have this amount of parts." << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "Every JPEG and PNG image with a '.pts' file in the given directories" << std::endl;
+    std::cerr << "(and their subdirectories) is indexed." << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+
+void main_parseOptions( int argc, char **argv )
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'o':
+                outputFileName = string(optarg);
+                break;
+            case 'n':
+                expectedParts = atoi(optarg);
+                break;
+            default: /* '?' */
+                main_usage();
+        }
+    }
+    for (int i = optind; i < argc; ++i)
+        directories.push_back(argv[i]);
+    if (outputFileName.empty() || directories.empty())
+    {
+		main_usage();
+	}
+}
+
+
+static bool main_isImage( const string &fileName )
+{
+	size_t pos = fileName.find_last_of('.');
+	if (pos == string::npos) return false;
+	string extension = fileName.substr(pos + 1);
+	for (size_t i = 0; i < extension.length(); ++i)
+		extension[i] = (char) tolower(extension[i]);
+	return extension == "jpg" || extension == "jpeg" || extension == "png";
+}
+
+
+/**
+ * Identifies a directory by its device and inode, so the same directory
+ * reached through several paths (e.g. symbolic links) is listed once.
+ */
+typedef pair<dev_t, ino_t> DirectoryId;
+
+
+/**
+ * List the given directory, appending the images to 'images' and the
+ * subdirectories (with their identifiers) to 'subdirectories'.
+ */
+static void main_listDirectory(
+	const string &directory,
+	vector<string> &images,
+	vector< pair<string, DirectoryId> > &subdirectories )
+{
+	DIR *dir = opendir(directory.c_str());
+	if (dir == NULL) return;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		string path = directory + "/" + entry->d_name;
+
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0) continue;
+		if (S_ISDIR(info.st_mode))
+			subdirectories.push_back(make_pair(path, DirectoryId(info.st_dev, info.st_ino)));
+		else
+		if (S_ISREG(info.st_mode) && main_isImage(path))
+			images.push_back(path);
+	}
+	closedir(dir);
+}
+
+
+/**
+ * Read the dimensions of a JPEG or PNG image from its header.
+ */
+static bool main_readDimensions(
+	const string &fileName,
+	int &width,
+	int &height )
+{
+	FILE *fp = fopen(fileName.c_str(), "rb");
+	if (fp == NULL) return false;
+
+	unsigned char header[24];
+	bool found = false;
+	if (fread(header, 1, 2, fp) == 2)
+	{
+		if (header[0] == 0x89 && header[1] == 'P')
+		{
+			// PNG: the IHDR chunk is the first one
+			if (fread(header + 2, 1, 22, fp) == 22 && memcmp(header + 12, "IHDR", 4) == 0)
+			{
+				width = (header[16] << 24) | (header[17] << 16) | (header[18] << 8) | header[19];
+				height = (header[20] << 24) | (header[21] << 16) | (header[22] << 8) | header[23];
+				found = true;
+			}
+		}
+		else
+		if (header[0] == 0xFF && header[1] == 0xD8)
+		{
+			// JPEG: look for the 'start of frame' segment
+			unsigned char marker[4];
+			while (!found && fread(marker, 1, 4, fp) == 4 && marker[0] == 0xFF)
+			{
+				const int length = (marker[2] << 8) | marker[3];
+				if (marker[1] >= 0xC0 && marker[1] <= 0xCF && marker[1] != 0xC4 &&
+					marker[1] != 0xC8 && marker[1] != 0xCC)
+				{
+					unsigned char frame[5];
+					if (fread(frame, 1, 5, fp) != 5) break;
+					height = (frame[1] << 8) | frame[2];
+					width = (frame[3] << 8) | frame[4];
+					found = true;
+				}
+				else
+				if (length < 2 || fseek(fp, length - 2, SEEK_CUR) != 0)
+					break;
+			}
+		}
+	}
+	fclose(fp);
+	return found && width > 0 && height > 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	main_parseOptions(argc, argv);
+
+	try
+	{
+		// walk the directory trees one level at a time, listing the
+		// directories of each level in parallel. Symbolic links are followed,
+		// but every directory is visited once, so link cycles end the walk.
+		vector<string> images;
+		set<DirectoryId> visited;
+		vector<string> level;
+		for (size_t i = 0; i < directories.size(); ++i)
+		{
+			struct stat info;
+			if (stat(directories[i].c_str(), &info) == 0 &&
+				visited.insert(DirectoryId(info.st_dev, info.st_ino)).second)
+				level.push_back(directories[i]);
+		}
+		while (!level.empty())
+		{
+			vector< vector<string> > levelImages(level.size());
+			vector< vector< pair<string, DirectoryId> > > levelDirectories(level.size());
+			#pragma omp parallel for schedule(dynamic, 1)
+			for (long i = 0; i < (long) level.size(); ++i)
+				main_listDirectory(level[i], levelImages[i], levelDirectories[i]);
+
+			vector<string> next;
+			for (size_t i = 0; i < level.size(); ++i)
+			{
+				images.insert(images.end(), levelImages[i].begin(), levelImages[i].end());
+				for (size_t j = 0; j < levelDirectories[i].size(); ++j)
+				{
+					if (visited.insert(levelDirectories[i][j].second).second)
+						next.push_back(levelDirectories[i][j].first);
+				}
+			}
+			level.swap(next);
+		}
+		std::sort(images.begin(), images.end());
+
+		// validate the images and their annotations
+		vector<IndexEntry> entries(images.size());
+		#pragma omp parallel for schedule(dynamic, 16)
+		for (long i = 0; i < (long) images.size(); ++i)
+		{
+			IndexEntry &entry = entries[i];
+			entry.imageFileName = images[i];
+			entry.valid = false;
+
+			struct stat info;
+			if (stat(entry.imageFileName.c_str(), &info) != 0) continue;
+			entry.size = info.st_size;
+			if (!main_readDimensions(entry.imageFileName, entry.width, entry.height)) continue;
+
+			ObjectDetection annot;
+			annot.load(SampleList::changeExtension(entry.imageFileName, "pts"));
+			if (annot.num_parts() == 0) continue;
+			if (expectedParts > 0 && annot.num_parts() != (unsigned long) expectedParts) continue;
+			entry.valid = true;
+		}
+
+		size_t count = 0;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (entries[i].valid)
+				++count;
+			else
+				std::cout << "   Ignoring file " << entries[i].imageFileName << std::endl;
+		}
+
+		std::ofstream output(outputFileName.c_str());
+		if (!output.good())
+			throw std::runtime_error("Unable to create the script file " + outputFileName);
+		output << count << std::endl;
+		for (size_t i = 0; i < entries.size(); ++i)
+		{
+			if (!entries[i].valid) continue;
+			output << entries[i].imageFileName << '\t' << entries[i].size << '\t' <<
+				entries[i].width << '\t' << entries[i].height << std::endl;
+		}
+		if (!output.good())
+			throw std::runtime_error("Unable to write the script file " + outputFileName);
+
+		std::cout << "Indexed " << count << " of " << entries.size() << " images" << std::endl;
+	} catch (exception& e)
+	{
+		cout << "Exception thrown!" << endl;
+		cout << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
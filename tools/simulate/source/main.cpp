@@ -3,6 +3,7 @@
 #include <face-detector/detector.hpp>
 #include <ert/ShapePredictorTrainer.hh>
 #include <ert/SampleList.hh>
+#include <ert/opencv.hh>
 
 #include <iostream>
 #include <fstream>
@@ -124,18 +125,7 @@ bool main_load(
 	ObjectDetection &annot )
 {
 	// load the image
-#if (0)
-	cv::cvtColor(imread(line), image, CV_BGR2GRAY);
-#else
-	cv::Mat temp[3];
-	cv::split(imread(imageFileName), temp);
-	temp[0].convertTo(temp[0], CV_32F);
-	temp[1].convertTo(temp[1], CV_32F);
-	temp[2].convertTo(temp[2], CV_32F);
-	image = temp[0] + temp[1] + temp[2];
-	image /= 3.0;
-	image.convertTo(image, CV_8U);
-#endif
+	bgr_to_gray(imread(imageFileName), image);
 
 	CascadeClassifier *faceCascade = new CascadeClassifier(FACE_CASCADE_FILE);
 	ViolaJones *detector = new ViolaJones(faceCascade);
@@ -3,6 +3,7 @@
 #include <face-detector/detector.hpp>
 #include <ert/ShapePredictorTrainer.hh>
 #include <ert/SampleList.hh>
+#include <ert/SampleStream.hh>
 
 #include <iostream>
 #include <fstream>
@@ -61,6 +62,46 @@ double main_length( const Point2f &p )
 }
 
 
+/**
+ * Fit the model to the annotated face of the given image and save the points
+ * next to the image.
+ */
+void main_fit(
+	ShapePredictor &model,
+	ViolaJones *detector,
+	const std::string &imageFileName,
+	const cv::Mat &image,
+	const ObjectDetection &annot )
+{
+	// using only the first face in each image
+
+	Rect face;
+#if (0)
+	if (!detector->detect(image, face)) return;
+
+	Rect diff = annot.get_rect();
+	diff.x -= face.x;
+	diff.y -= face.y;
+	diff.width -= face.width;
+	diff.height -= face.height;
+	std::cout << "Original - Viola-Jones = " << diff << std::endl;
+#endif
+	face = annot.get_rect();
+
+	ObjectDetection det = model.detect(image, face);
+	std::string fitFileName = SampleList::changeExtension(imageFileName, "fit");
+	std::cout << "Saving fitted points to " <<  fitFileName << std::endl;
+	det.save(fitFileName);
+#if (0)
+	for (int j = 0; j < (int)det.num_parts(); ++j)
+	{
+			std::cout << "Gold: " << annot.part(j) <<
+				"\tFit: " << det.part(j) << std::endl;
+	}
+#endif
+}
+
+
 
 int main(int argc, char** argv)
 {
@@ -74,40 +115,25 @@ int main(int argc, char** argv)
 		model.deserialize(input);
 		input.close();
 
-		SampleList script(evaluateScriptFileName);
-
 		CascadeClassifier faceCascade(FACE_CASCADE_FILE);
 		ViolaJones *detector = new ViolaJones(&faceCascade);
 
-		for (size_t i = 0; i < script.getImages().size(); ++i)
-        {
-			// using only the first face in each image
-
-			Rect face;
-#if (0)
-			if (!detector->detect(*script.getImages()[i], face)) continue;
-
-			Rect diff = script.getAnnotations()[i][0]->get_rect();
-			diff.x -= face.x;
-			diff.y -= face.y;
-			diff.width -= face.width;
-			diff.height -= face.height;
-			std::cout << "Original - Viola-Jones = " << diff << std::endl;
-#endif
-			face = script.getAnnotations()[i][0]->get_rect();
-
-			ObjectDetection det = model.detect(*script.getImages()[i], face);
-			std::string fitFileName = script.getFileName(i, "fit");
-			std::cout << "Saving fitted points to " <<  fitFileName << std::endl;
-			det.save(fitFileName);
-#if (0)
-			for (int j = 0; j < (int)det.num_parts(); ++j)
-			{
-					std::cout << "Gold: " << script.getAnnotations()[i][0]->part(j) <<
-						"\tFit: " << det.part(j) << std::endl;
-			}
-#endif
-        }
+		if (SampleList::isCache(evaluateScriptFileName))
+		{
+			// the cache is mapped in memory, so there is nothing to stream
+			SampleList script(evaluateScriptFileName);
+			for (uint32_t i = 0; i < script.getImages().size(); ++i)
+				main_fit(model, detector, script.getImageFileName(i), script.getImage(i), script.getAnnotation(i));
+		}
+		else
+		{
+			// the images are decoded in background while the model runs, and
+			// only a few of them are kept in memory
+			SampleStream script(evaluateScriptFileName, NULL, 16, 2);
+			SampleStream::Sample sample;
+			while (script.next(sample))
+				main_fit(model, detector, sample.imageFileName, sample.image, sample.annot);
+		}
 
         delete detector;
 
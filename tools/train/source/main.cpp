@@ -3,12 +3,19 @@
 #include <face-detector/detector.hpp>
 #include <ert/ShapePredictorTrainer.hh>
 #include <ert/SampleList.hh>
+#include <ert/AnnotationFile.hh>
+#include <ert/SampleStream.hh>
 #include <ert/opencv.hh>
 
 
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cstdio>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <map>
 #include <getopt.h>
 
 
@@ -34,6 +41,73 @@ static int configTreeDepth = 0;
 
 static int configTestSplits = 0;
 
+static bool useHistogramSplits = false;
+
+static string configRandomSeed = "";
+
+static double configTreeFraction = 1;
+
+static int configSplitSamples = 0;
+
+static string checkpointFileName = "";
+
+static bool resumeTraining = false;
+
+static string validationScriptFileName = "";
+
+static string warmStartFileName = "";
+
+static string sweepFileName = "";
+
+static string telemetryFileName = "";
+
+static string spillDirectory = "";
+
+static int numProcesses = 1;
+
+static int sweepJobs = 1;
+
+static string packFileName = "";
+
+static int faceSize = 0;
+
+static string annotationFileName = "";
+
+static string evaluationJsonFileName = "";
+
+static vector<int> evaluationThreads;
+
+static int augmentationAmount = 0;
+
+static bool useMirror = false;
+
+static double rotationJitter = 0;
+
+static double scaleJitter = 0;
+
+/**
+ * Part that each part of the 68 points layout becomes in mirrored faces.
+ */
+static const unsigned long MIRROR_68_PARTS[] =
+{
+	// face contour
+	16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	// eyebrows
+	26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+	// nose
+	27, 28, 29, 30, 35, 34, 33, 32, 31,
+	// eyes
+	45, 44, 43, 42, 47, 46, 39, 38, 37, 36, 41, 40,
+	// outer mouth
+	54, 53, 52, 51, 50, 49, 48, 59, 58, 57, 56, 55,
+	// inner mouth
+	64, 63, 62, 61, 60, 67, 66, 65
+};
+
+static vector<string> groupNames;
+
+static vector< vector<unsigned long> > groupParts;
+
 
 class MainSampleLoader : public SampleLoader
 {
@@ -48,6 +122,8 @@ class MainSampleLoader : public SampleLoader
 			cv::Mat &image,
 			ObjectDetection &annot );
 
+		bool isThreadSafe() const;
+
 	private:
 		ViolaJones *detector;
 		CascadeClassifier *faceCascade;
@@ -70,6 +146,12 @@ MainSampleLoader::~MainSampleLoader()
 }
 
 
+bool MainSampleLoader::isThreadSafe() const
+{
+	return true;
+}
+
+
 void MainSampleLoader::load(
 	const std::string &imageFileName,
 	cv::Mat &image,
@@ -77,39 +159,29 @@ void MainSampleLoader::load(
 {
 	//static float originalSize = 0, croppedSize = 0;
 
-	// load the image
-	cv::Mat source = imread(imageFileName);
+	// load the annotations
+	loadAnnotations(imageFileName, annot);
+
+	// load the image (reduced according to the face size)
 	cv::Mat gray;
-#if (0)
-	cv::cvtColor(source, gray, CV_BGR2GRAY);
-#else
-	cv::Mat temp[3];
-	cv::split(source, temp);
-	temp[0].convertTo(temp[0], CV_32F);
-	temp[1].convertTo(temp[1], CV_32F);
-	temp[2].convertTo(temp[2], CV_32F);
-	gray = temp[0] + temp[1] + temp[2];
-	gray /= 3.0;
-	gray.convertTo(gray, CV_8U);
-#endif
-	source.release();
+	double scale = readImage(imageFileName, annot, gray);
+	if (scale != 1)
+	{
+		annot /= (float) (1.0 / scale);
+		annot.computeBoundingBox(0.1);
+	}
 
 	Rect face;
-	if (useViolaJones && !detector->detect(gray, face))
-		throw 1;
-
-	// load the annotations
-	std::string pointsFile = SampleList::changeExtension(imageFileName, "pts");
-	try
+	// the cascade classifier is shared by the loading threads
+	bool found = true;
+	if (useViolaJones)
 	{
-		annot.load(pointsFile);
-		if (useViolaJones) annot.set_rect(face);
-		// remove the first 17 points
-		annot.remove(0, 16);
-	} catch (...)
-	{
-		std::cout << "   Ignoring file " << pointsFile << std::endl;
+		#pragma omp critical (main_detector)
+		found = detector->detect(gray, face);
 	}
+	if (!found)
+		throw 1;
+	if (useViolaJones) annot.set_rect(face);
 
 	// crop the original image to save memory
 	if (!useViolaJones)
@@ -178,8 +250,10 @@ std::vector<std::vector<double> > get_interocular_distances (
 
 void main_usage()
 {
-    std::cerr << "Usage: tool_train -t <script file> -m <model file> [ -v -a ]" << std::endl;
-    std::cerr << "       tool_train -e <script file> -m <model file> [ -v -a ]" << std::endl << std::endl;
+    std::cerr << "Usage: tool_train -t <script file> -m <model file> [ -v -a -d <depth> -s <splits> -H -r <seed> -f <fraction> -S <samples> -c <checkpoint file> --resume -V <script file> -w <model file> -T <telemetry file> -D <directory> -P <processes> -g <name>=<parts> -F <pixels> -A <annotation file> -u <copies> -M -O <degrees> -J <fraction> ]" << std::endl;
+    std::cerr << "       tool_train -e <script file> -m <model file> [ -v -a -N <threads> -E <JSON file> ]" << std::endl;
+    std::cerr << "       tool_train -t <script file> -k <cache file> [ -v -F <pixels> -A <annotation file> ]" << std::endl;
+    std::cerr << "       tool_train -t <script file> -x <sweep file> [ -e <script file> -j <jobs> ... ]" << std::endl << std::endl;
     std::cerr << "   -t  Train a new model using the given script file" << std::endl;
     std::cerr << "   -e  Evaluate an existing model using the given script file" << std::endl;
     std::cerr << "   -m  Model file name. In evaluate mode this file must exists." << std::endl;
@@ -188,15 +262,120 @@ void main_usage()
     std::cerr << "       10% border)." << std::endl;
     std::cerr << "   -a  Show absolute errors. The default behavior is normalize" << std::endl;
     std::cerr << "       the error by the face size." << std::endl;
+    std::cerr << "   -d  Depth of the regression trees." << std::endl;
+    std::cerr << "   -s  Number of candidate splits tested at each tree node." << std::endl;
+    std::cerr << "   -H  Find the best threshold of each candidate split using an" << std::endl;
+    std::cerr << "       histogram of pixel differences (allows much more splits)." << std::endl;
+    std::cerr << "   -r  Random seed. Training with the same seed produces the same" << std::endl;
+    std::cerr << "       model regardless of the number of threads." << std::endl;
+    std::cerr << "   -f  Build each tree using a random fraction of the samples (e.g. 0.5)." << std::endl;
+    std::cerr << "   -S  Test the splits of large tree nodes using only this amount of" << std::endl;
+    std::cerr << "       random samples." << std::endl;
+    std::cerr << "   -c  Checkpoint file name. The training state is saved periodically" << std::endl;
+    std::cerr << "       in this file (default is the model file name plus '.checkpoint')." << std::endl;
+    std::cerr << "   --resume  Continue the training from the checkpoint file." << std::endl;
+    std::cerr << "   -V  Validation script file. Each cascade level stops adding trees" << std::endl;
+    std::cerr << "       once the error on these samples stops improving." << std::endl;
+    std::cerr << "   -w  Continue the training of an existing model (e.g. to add trees or" << std::endl;
+    std::cerr << "       cascade levels, or to fine-tune it with another dataset)." << std::endl;
+    std::cerr << "   -T  Write training figures (time of each phase, throughput, memory" << std::endl;
+    std::cerr << "       and error of each cascade level) as JSON lines to this file." << std::endl;
+    std::cerr << "   -D  Keep the training samples in temporary files in this directory" << std::endl;
+    std::cerr << "       (for datasets that do not fit in memory)." << std::endl;
+    std::cerr << "   -P  Build the trees with this amount of processes, each one with a" << std::endl;
+    std::cerr << "       part of the samples (no validation, subsampling or histogram" << std::endl;
+    std::cerr << "       splits)." << std::endl;
+    std::cerr << "   -g  Train a model with only the given parts (e.g. 'mouth=48-67' or" << std::endl;
+    std::cerr << "       'jaw=0-16,27') instead of the full model. May be given more" << std::endl;
+    std::cerr << "       than once to train several models at the same time; each one" << std::endl;
+    std::cerr << "       is saved in the model file name plus '.' plus the group name." << std::endl;
+    std::cerr << "   -F  Reduce the images at load time so the larger side of the face" << std::endl;
+    std::cerr << "       bounding box has this size in pixels." << std::endl;
+    std::cerr << "   -N  Evaluate the model in parallel with each of the given amounts" << std::endl;
+    std::cerr << "       of threads (e.g. '1,2,4,8') and show the error of each part," << std::endl;
+    std::cerr << "       the detection time percentiles and the throughput." << std::endl;
+    std::cerr << "   -E  Write the evaluation results (one JSON object per amount of" << std::endl;
+    std::cerr << "       threads) to this file." << std::endl;
+    std::cerr << "   -u  Add this amount of augmented copies of each face (made in" << std::endl;
+    std::cerr << "       memory at the beginning of the training)." << std::endl;
+    std::cerr << "   -M  Mirror every other augmented copy (68 points layout only)." << std::endl;
+    std::cerr << "   -O  Rotate the augmented copies up to this amount of degrees." << std::endl;
+    std::cerr << "   -J  Scale the augmented copies up to this fraction (e.g. 0.1)." << std::endl;
+    std::cerr << "   -A  Read the annotations from this bulk annotation file (see" << std::endl;
+    std::cerr << "       'tool_annotations') instead of the '.pts' file of each image." << std::endl;
+    std::cerr << "   -k  Save the samples of the '-t' script (cropped gray images and" << std::endl;
+    std::cerr << "       annotations) in a cache file. Cache files can be used instead" << std::endl;
+    std::cerr << "       of script files and load much faster." << std::endl;
+    std::cerr << "   -x  Train every configuration in the given sweep file and print the" << std::endl;
+    std::cerr << "       error and the detection time of each one. Each line of the file" << std::endl;
+    std::cerr << "       is a configuration with 'name=value' pairs, where 'name' is one" << std::endl;
+    std::cerr << "       of depth, splits, nu, lambda, trees, cascades and pool. The" << std::endl;
+    std::cerr << "       error is measured with the '-e' script (if any)." << std::endl;
+    std::cerr << "   -j  Number of sweep configurations trained at the same time." << std::endl;
     exit(EXIT_FAILURE);
 }
 
 
+/**
+ * Parse a part group in the format 'name=first-last,index,...'.
+ */
+void main_parseGroup( const std::string &value )
+{
+	size_t pos = value.find('=');
+	if (pos == std::string::npos || pos == 0)
+		main_usage();
+
+	std::vector<unsigned long> parts;
+	std::stringstream ranges(value.substr(pos + 1));
+	std::string range;
+	while (std::getline(ranges, range, ','))
+	{
+		unsigned long first, last;
+		char dash;
+		std::stringstream tokens(range);
+		if (!(tokens >> first)) main_usage();
+		if (tokens >> dash)
+		{
+			if (dash != '-' || !(tokens >> last) || last < first) main_usage();
+		}
+		else
+			last = first;
+		for (unsigned long i = first; i <= last; ++i)
+			parts.push_back(i);
+	}
+	if (parts.empty())
+		main_usage();
+
+	groupNames.push_back(value.substr(0, pos));
+	groupParts.push_back(parts);
+}
+
+
 void main_parseOptions( int argc, char **argv )
 {
+    static struct option longOptions[] =
+    {
+        { "resume", no_argument, NULL, 'R' },
+        { "validate", required_argument, NULL, 'V' },
+        { "warm-start", required_argument, NULL, 'w' },
+        { "telemetry", required_argument, NULL, 'T' },
+        { "spill", required_argument, NULL, 'D' },
+        { "processes", required_argument, NULL, 'P' },
+        { "group", required_argument, NULL, 'g' },
+        { "pack", required_argument, NULL, 'k' },
+        { "face-size", required_argument, NULL, 'F' },
+        { "annotations", required_argument, NULL, 'A' },
+        { "augment", required_argument, NULL, 'u' },
+        { "mirror", no_argument, NULL, 'M' },
+        { "rotate", required_argument, NULL, 'O' },
+        { "scale-jitter", required_argument, NULL, 'J' },
+        { "json", required_argument, NULL, 'E' },
+        { "threads", required_argument, NULL, 'N' },
+        { NULL, 0, NULL, 0 }
+    };
     int opt;
 
-    while ((opt = getopt(argc, argv, "t:e:m:avd:s:")) != -1)
+    while ((opt = getopt_long(argc, argv, "t:e:m:avd:s:Hr:f:S:c:V:w:x:j:T:D:P:g:k:F:A:u:MO:J:E:N:", longOptions, NULL)) != -1)
     {
         switch (opt)
         {
@@ -221,40 +400,471 @@ void main_parseOptions( int argc, char **argv )
 			case 'd':
 				configTreeDepth = atoi(optarg);
 				break;
+			case 'H':
+				useHistogramSplits = true;
+				break;
+			case 'r':
+				configRandomSeed = string(optarg);
+				break;
+			case 'f':
+				configTreeFraction = atof(optarg);
+				break;
+			case 'S':
+				configSplitSamples = atoi(optarg);
+				break;
+			case 'c':
+				checkpointFileName = string(optarg);
+				break;
+			case 'R':
+				resumeTraining = true;
+				break;
+			case 'V':
+				validationScriptFileName = string(optarg);
+				break;
+			case 'w':
+				warmStartFileName = string(optarg);
+				break;
+			case 'T':
+				telemetryFileName = string(optarg);
+				break;
+			case 'D':
+				spillDirectory = string(optarg);
+				break;
+			case 'P':
+				numProcesses = atoi(optarg);
+				break;
+			case 'g':
+				main_parseGroup(optarg);
+				break;
+			case 'u':
+				augmentationAmount = atoi(optarg);
+				break;
+			case 'M':
+				useMirror = true;
+				break;
+			case 'O':
+				rotationJitter = atof(optarg);
+				break;
+			case 'J':
+				scaleJitter = atof(optarg);
+				break;
+			case 'E':
+				evaluationJsonFileName = string(optarg);
+				break;
+			case 'N':
+			{
+				std::stringstream values(optarg);
+				std::string value;
+				while (std::getline(values, value, ','))
+				{
+					if (atoi(value.c_str()) <= 0) main_usage();
+					evaluationThreads.push_back(atoi(value.c_str()));
+				}
+				break;
+			}
+			case 'A':
+				annotationFileName = string(optarg);
+				break;
+			case 'F':
+				faceSize = atoi(optarg);
+				break;
+			case 'k':
+				packFileName = string(optarg);
+				break;
+			case 'x':
+				sweepFileName = string(optarg);
+				break;
+			case 'j':
+				sweepJobs = atoi(optarg);
+				break;
             default: /* '?' */
                 main_usage();
         }
     }
-    if ((trainScriptFileName.empty() && evaluateScriptFileName.empty()) || modelFileName.empty())
+    if ((trainScriptFileName.empty() && evaluateScriptFileName.empty()) ||
+        (modelFileName.empty() && sweepFileName.empty() && packFileName.empty()) ||
+        (!packFileName.empty() && trainScriptFileName.empty()) ||
+        (!sweepFileName.empty() && trainScriptFileName.empty()) ||
+        (!groupNames.empty() && (trainScriptFileName.empty() || !sweepFileName.empty() ||
+            !validationScriptFileName.empty() || !warmStartFileName.empty())))
     {
 		main_usage();
 	}
+	if (checkpointFileName.empty())
+		checkpointFileName = modelFileName + ".checkpoint";
+}
+
+void main_configureTrainer( ShapePredictorTrainer &trainer )
+{
+	trainer.set_oversampling_amount(20);
+	trainer.set_cascade_depth(10);
+	trainer.set_num_trees_per_cascade_level(500);
+	//trainer.set_nu(0.05);
+	if (configTreeDepth != 0)
+		trainer.set_tree_depth(configTreeDepth);
+	if (configTestSplits != 0)
+		trainer.set_num_test_splits(configTestSplits);
+	if (useHistogramSplits)
+		trainer.set_split_strategy(ShapePredictorTrainer::SPLIT_HISTOGRAM);
+	trainer.set_random_seed(configRandomSeed);
+	if (configTreeFraction > 0 && configTreeFraction < 1)
+		trainer.set_tree_subsampling_fraction(configTreeFraction);
+	if (configSplitSamples > 0)
+		trainer.set_split_subsampling_size(configSplitSamples);
+	trainer.set_spill_directory(spillDirectory);
+	if (augmentationAmount > 0)
+	{
+		trainer.set_augmentation_amount(augmentationAmount);
+		if (useMirror)
+		{
+			trainer.set_mirror_map(std::vector<unsigned long>(MIRROR_68_PARTS,
+				MIRROR_68_PARTS + sizeof(MIRROR_68_PARTS) / sizeof(MIRROR_68_PARTS[0])));
+		}
+		trainer.set_rotation_jitter(rotationJitter);
+		trainer.set_scale_jitter(scaleJitter);
+	}
+}
+
+
+struct SweepConfig
+{
+	ShapePredictorTrainer trainer;
+	std::string description;
+	std::string error;
+	ShapePredictor model;
+};
+
+
+/**
+ * Load the sweep configurations from the given file. Each line contains the
+ * trainer parameters that differ from the 'tool_train' defaults.
+ */
+void main_loadSweep(
+	const std::string &fileName,
+	std::vector<SweepConfig> &configs )
+{
+	std::ifstream input(fileName.c_str());
+	if (!input.good())
+		throw std::runtime_error("Unable to open the sweep file " + fileName);
+
+	std::string line;
+	while (std::getline(input, line))
+	{
+		std::stringstream tokens(line);
+		std::string token;
+		if (!(tokens >> token) || token[0] == '#') continue;
+
+		SweepConfig config;
+		main_configureTrainer(config.trainer);
+		config.trainer.be_quiet();
+		config.description = line;
+		do
+		{
+			size_t pos = token.find('=');
+			if (pos == std::string::npos)
+				throw std::runtime_error("Invalid sweep parameter '" + token + "'");
+			std::string name = token.substr(0, pos);
+			std::string value = token.substr(pos + 1);
+
+			if (name == "depth")
+				config.trainer.set_tree_depth(atoi(value.c_str()));
+			else
+			if (name == "splits")
+				config.trainer.set_num_test_splits(atoi(value.c_str()));
+			else
+			if (name == "nu")
+				config.trainer.set_nu(atof(value.c_str()));
+			else
+			if (name == "lambda")
+				config.trainer.set_lambda(atof(value.c_str()));
+			else
+			if (name == "trees")
+				config.trainer.set_num_trees_per_cascade_level(atoi(value.c_str()));
+			else
+			if (name == "cascades")
+				config.trainer.set_cascade_depth(atoi(value.c_str()));
+			else
+			if (name == "pool")
+				config.trainer.set_feature_pool_size(atoi(value.c_str()));
+			else
+				throw std::runtime_error("Invalid sweep parameter '" + token + "'");
+		} while (tokens >> token);
+
+		configs.push_back(config);
+	}
+}
+
+
+void main_sweep(
+	const SampleList &script,
+	const SampleList *evaluation )
+{
+	std::vector<SweepConfig> configs;
+	main_loadSweep(sweepFileName, configs);
+
+	// Configurations with the same feature pool size, random seed and
+	// oversampling amount start from the same state (i.e. same initial shapes,
+	// feature pools and first level features), so we compute it once for each
+	// group. The lambda only weights the split features, which are drawn later.
+	typedef std::pair<unsigned long, std::pair<std::string, unsigned long> > StateKey;
+	std::map<StateKey, size_t> groups;
+	std::vector<unsigned long> depths;
+	std::vector<size_t> configGroup(configs.size());
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		const ShapePredictorTrainer &trainer = configs[i].trainer;
+		StateKey key(trainer.get_feature_pool_size(),
+			std::make_pair(trainer.get_random_seed(), trainer.get_oversampling_amount()));
+		std::map<StateKey, size_t>::iterator it = groups.find(key);
+		if (it == groups.end())
+		{
+			it = groups.insert(std::make_pair(key, depths.size())).first;
+			depths.push_back(0);
+		}
+		configGroup[i] = it->second;
+		depths[it->second] = std::max(depths[it->second], configs[i].trainer.get_cascade_depth());
+	}
+
+	std::vector<InitialTrainingState> states(depths.size());
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		size_t group = configGroup[i];
+		if (states[group].samples.empty())
+		{
+			ShapePredictorTrainer trainer = configs[i].trainer;
+			trainer.set_cascade_depth(depths[group]);
+			trainer.prepare_initial_state(script.getImages(), script.getAnnotations(), states[group]);
+		}
+		configs[i].trainer.set_initial_state(&states[group]);
+	}
+
+	std::cout << "Training " << configs.size() << " configurations (" << states.size() <<
+		" initial states)..." << std::endl;
+
+	// the configurations are trained concurrently; the training of each one
+	// runs in a single thread when more than one job is used
+	#pragma omp parallel for schedule(dynamic, 1) num_threads(sweepJobs)
+	for (long i = 0; i < (long) configs.size(); ++i)
+	{
+		try
+		{
+			configs[i].model = configs[i].trainer.train(script.getImages(), script.getAnnotations());
+		} catch (std::exception &e)
+		{
+			configs[i].error = e.what();
+		} catch (...)
+		{
+			configs[i].error = "unknown error";
+		}
+		#pragma omp critical
+		std::cout << "   Finished " << configs[i].description << std::endl;
+	}
+
+	// the evaluation runs serially to get meaningful detection times
+	const SampleList &test = (evaluation != NULL) ? *evaluation : script;
+	std::vector<std::vector<double> > distances = get_interocular_distances(test.getAnnotations());
+
+	std::cout << std::endl << std::setw(12) << "Error" << std::setw(12) << "ms/face" << "   Configuration" << std::endl;
+	for (size_t i = 0; i < configs.size(); ++i)
+	{
+		if (!configs[i].error.empty())
+		{
+			std::cout << std::setw(24) << "failed" << "   " << configs[i].description <<
+				" (" << configs[i].error << ")" << std::endl;
+			continue;
+		}
+
+		ShapePredictorEvaluation result = evaluate_shape_predictor(configs[i].model,
+			test.getImages(), test.getAnnotations(), distances, 1);
+
+		std::cout << std::setw(12) << result.mean_error << std::setw(12) << result.mean_latency <<
+			"   " << configs[i].description << std::endl;
+	}
+}
+
+
+/**
+ * Train one model for each part group. The models are trained at the same
+ * time from the same images.
+ */
+void main_trainGroups(
+	const ShapePredictorTrainer &trainer,
+	const SampleList &script )
+{
+	std::vector<ShapePredictor> models = trainer.train_part_groups(script.getImages(),
+		script.getAnnotations(), groupParts);
+
+	// the errors are normalized by the interocular distance of the full shapes
+	const std::vector<std::vector<ObjectDetection*> > &objects = script.getAnnotations();
+	std::vector<std::vector<double> > distances = get_interocular_distances(objects);
+
+	std::cout << std::endl;
+	for (size_t g = 0; g < models.size(); ++g)
+	{
+		std::string fileName = modelFileName + "." + groupNames[g];
+		std::ofstream output(fileName.c_str());
+		models[g].serialize(output);
+		output.close();
+		std::stringstream checkpoint;
+		checkpoint << checkpointFileName << "." << g;
+		std::remove(checkpoint.str().c_str());
+
+		std::vector<ObjectDetection> subsets;
+		std::vector<std::vector<ObjectDetection*> > subsetObjects(objects.size());
+		for (size_t i = 0; i < objects.size(); ++i)
+			for (size_t j = 0; j < objects[i].size(); ++j)
+				subsets.push_back(objects[i][j]->subset(groupParts[g]));
+		for (size_t i = 0, k = 0; i < objects.size(); ++i)
+			for (size_t j = 0; j < objects[i].size(); ++j)
+				subsetObjects[i].push_back(&subsets[k++]);
+
+		std::cout << "Mean training error of '" << groupNames[g] << "' (" <<
+			groupParts[g].size() << " parts): " <<
+			test_shape_predictor(models[g], script.getImages(), subsetObjects, distances) <<
+			std::endl;
+	}
+}
+
+
+/**
+ * Evaluate the model in parallel with each amount of threads given in the
+ * command line, printing (and saving as JSON lines) the results. Returns the
+ * mean error.
+ */
+double main_evaluate(
+	const ShapePredictor &model,
+	const SampleList &script )
+{
+	std::vector<std::vector<double> > distances = get_interocular_distances(script.getAnnotations());
+	std::vector<int> threads = evaluationThreads;
+	if (threads.empty()) threads.push_back(0);
+
+	std::ofstream json;
+	if (!evaluationJsonFileName.empty())
+	{
+		json.open(evaluationJsonFileName.c_str());
+		if (!json.good())
+			throw std::runtime_error("Unable to create the file " + evaluationJsonFileName);
+	}
+
+	std::vector<ShapePredictorEvaluation> results;
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		results.push_back(evaluate_shape_predictor(model, script.getImages(), script.getAnnotations(),
+			distances, threads[i]));
+		if (json.is_open())
+		{
+			results.back().write_json(json);
+			json << std::endl;
+		}
+	}
+
+	// the errors do not depend on the threads
+	const ShapePredictorEvaluation &first = results[0];
+	std::cout << std::endl << "Error of each part:" << std::endl;
+	for (size_t k = 0; k < first.part_errors.size(); ++k)
+		std::cout << std::setw(6) << k << std::setw(12) << first.part_errors[k] << std::endl;
+
+	std::cout << std::endl << std::setw(8) << "Threads" << std::setw(12) << "Faces/s" <<
+		std::setw(12) << "p50 (ms)" << std::setw(12) << "p95 (ms)" << std::setw(12) << "p99 (ms)" << std::endl;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		std::cout << std::setw(8) << results[i].threads << std::setw(12) << results[i].throughput <<
+			std::setw(12) << results[i].latency_p50 << std::setw(12) << results[i].latency_p95 <<
+			std::setw(12) << results[i].latency_p99 << std::endl;
+	}
+	return first.mean_error;
 }
 
+
 #include <unistd.h>
 
 int main(int argc, char** argv)
 {
 	main_parseOptions(argc, argv);
 
+	AnnotationFile *annotations = NULL;
+	if (!annotationFileName.empty())
+	{
+		try
+		{
+			annotations = new AnnotationFile(annotationFileName);
+		} catch (exception& e)
+		{
+			cout << "Exception thrown!" << endl;
+			cout << e.what() << endl;
+			return 1;
+		}
+	}
+
+	if (!packFileName.empty())
+	{
+		try
+		{
+			MainSampleLoader sloader = MainSampleLoader(useViolaJones);
+			sloader.setFaceSize(faceSize);
+			sloader.setAnnotationFile(annotations);
+			SampleList script(trainScriptFileName, &sloader);
+			script.save(packFileName);
+			cout << "Saved " << script.getImages().size() << " samples in " << packFileName << endl;
+		} catch (exception& e)
+		{
+			cout << "Exception thrown!" << endl;
+			cout << e.what() << endl;
+		}
+	}
+	else
+	if (!sweepFileName.empty())
+	{
+		try
+		{
+			MainSampleLoader sloader = MainSampleLoader(useViolaJones);
+			sloader.setFaceSize(faceSize);
+			sloader.setAnnotationFile(annotations);
+			SampleList script(trainScriptFileName, &sloader);
+			if (evaluateScriptFileName.empty())
+				main_sweep(script, NULL);
+			else
+			{
+				SampleList evaluation(evaluateScriptFileName, &sloader);
+				main_sweep(script, &evaluation);
+			}
+		} catch (exception& e)
+		{
+			cout << "Exception thrown!" << endl;
+			cout << e.what() << endl;
+		}
+	}
+	else
 	if (!trainScriptFileName.empty())
 	{
 		try
 		{
 			MainSampleLoader sloader = MainSampleLoader(useViolaJones);
+			sloader.setFaceSize(faceSize);
+			sloader.setAnnotationFile(annotations);
 			SampleList script(trainScriptFileName, &sloader);
 
 			// create the training object
 			ShapePredictorTrainer trainer;
-
-			trainer.set_oversampling_amount(20);
-			trainer.set_cascade_depth(10);
-			trainer.set_num_trees_per_cascade_level(500);
-			//trainer.set_nu(0.05);
-			if (configTreeDepth != 0)
-				trainer.set_tree_depth(configTreeDepth);
-			if (configTestSplits != 0)
-				trainer.set_num_test_splits(configTestSplits);
+			main_configureTrainer(trainer);
+			ShapePredictor warmStart;
+			if (!warmStartFileName.empty())
+			{
+				std::ifstream input(warmStartFileName.c_str());
+				if (!input.is_open())
+					throw std::runtime_error("Unable to open the warm start model " + warmStartFileName);
+				warmStart.deserialize(input);
+				if (input.fail())
+					throw std::runtime_error("Unable to read the warm start model " + warmStartFileName);
+				input.close();
+				trainer.set_warm_start(&warmStart);
+			}
+			trainer.set_checkpoint_file(checkpointFileName);
+			trainer.set_telemetry_file(telemetryFileName);
+			if (numProcesses > 1)
+				trainer.set_num_processes(numProcesses);
+			trainer.set_resume(resumeTraining);
 			trainer.be_verbose();
 
 			std::cout << "       Cascade depth: " << trainer.get_cascade_depth() << std::endl;
@@ -262,22 +872,48 @@ int main(int argc, char** argv)
 			std::cout << "          Tree depth: " << trainer.get_tree_depth() << std::endl;
 			std::cout << " Oversampling amount: " << trainer.get_oversampling_amount() << std::endl;
 			std::cout << "    Number of splits: " << trainer.get_num_test_splits() << std::endl;
+			std::cout << "    Samples per tree: " << trainer.get_tree_subsampling_fraction() * 100 << "%" << std::endl;
+			std::cout << "  Split search limit: " << trainer.get_split_subsampling_size() << " samples" << std::endl;
+			std::cout << "      Split strategy: " << ((useHistogramSplits) ? "histogram" : "random threshold") << std::endl;
             std::cout << "   Feature pool size: " << trainer.get_feature_pool_size() << std::endl;
             std::cout << "   Exp. prior lamdba: " << trainer.get_lambda() << std::endl;
-            std::cout << "Learning coefficient: " << trainer.get_nu() << std::endl << std::endl;
-
-			// generate the shape model and save in disk
-			ShapePredictor model = trainer.train(script.getImages(), script.getAnnotations());
-
-			if (!modelFileName.empty())
+            std::cout << "Learning coefficient: " << trainer.get_nu() << std::endl;
+            if (!warmStartFileName.empty())
+                std::cout << "          Warm start: " << warmStartFileName << " (" << warmStart.num_cascades() << " levels)" << std::endl;
+            std::cout << "         Random seed: \"" << trainer.get_random_seed() << "\"" << std::endl << std::endl;
+
+			if (!groupNames.empty())
+				main_trainGroups(trainer, script);
+			else
 			{
-				std::ofstream output(modelFileName.c_str());
-				model.serialize(output);
-				output.close();
+				// generate the shape model and save in disk
+				ShapePredictor model;
+				if (validationScriptFileName.empty())
+					model = trainer.train(script.getImages(), script.getAnnotations());
+				else
+				{
+					SampleList validation(validationScriptFileName, &sloader);
+					model = trainer.train(script.getImages(), script.getAnnotations(),
+						validation.getImages(), validation.getAnnotations());
+
+					std::cout << std::endl << "Trees per cascade level:";
+					for (unsigned long i = 0; i < model.num_cascades(); ++i)
+						std::cout << " " << model.num_trees(i);
+					std::cout << std::endl;
+				}
+
+				if (!modelFileName.empty())
+				{
+					std::ofstream output(modelFileName.c_str());
+					model.serialize(output);
+					output.close();
+					// the checkpoint is useless once the model is saved
+					std::remove(checkpointFileName.c_str());
+				}
+
+				cout << endl << "Mean training error: " <<
+					test_shape_predictor(model, script.getImages(), script.getAnnotations(), get_interocular_distances(script.getAnnotations())) << endl;
 			}
-
-			cout << endl << "Mean training error: " <<
-				test_shape_predictor(model, script.getImages(), script.getAnnotations(), get_interocular_distances(script.getAnnotations())) << endl;
 		} catch (exception& e)
 		{
 			cout << "Exception thrown!" << endl;
@@ -295,12 +931,31 @@ int main(int argc, char** argv)
 			input.close();
 
 			MainSampleLoader sloader = MainSampleLoader(useViolaJones);
-			SampleList script(evaluateScriptFileName, &sloader);
+			sloader.setFaceSize(faceSize);
+			sloader.setAnnotationFile(annotations);
 
 			// measures the average distance between the predicted face landmark
-			// and where it should be according to the truth data.
-			cout << endl << "Mean evaluating error: " <<
-				test_shape_predictor(model, script.getImages(), script.getAnnotations(), get_interocular_distances(script.getAnnotations())) << endl;
+			// and where it should be according to the truth data. Script files
+			// are streamed so the memory does not grow with the dataset.
+			double error;
+			if (!evaluationThreads.empty() || !evaluationJsonFileName.empty())
+			{
+				SampleList script(evaluateScriptFileName, &sloader);
+				error = main_evaluate(model, script);
+			}
+			else
+			if (SampleList::isCache(evaluateScriptFileName))
+			{
+				SampleList script(evaluateScriptFileName, &sloader);
+				error = test_shape_predictor(model, script.getImages(), script.getAnnotations(),
+					get_interocular_distances(script.getAnnotations()));
+			}
+			else
+			{
+				SampleStream script(evaluateScriptFileName, &sloader, 64, 4);
+				error = test_shape_predictor(model, script, interocular_distance);
+			}
+			cout << endl << "Mean evaluating error: " << error << endl;
 
 		} catch (exception& e)
 		{
@@ -308,4 +963,6 @@ int main(int argc, char** argv)
 			cout << e.what() << endl;
 		}
     }
+
+	delete annotations;
 }
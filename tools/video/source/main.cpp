@@ -352,7 +352,7 @@ std::cout << "'display'  Type " << display.type() << std::endl;
 		//bilateralFilter(frame, tempFrame, 16, 32, 8);
 		//frame = tempFrame;
         // convert the original frame to grayscale and look for landmarks
-        cvtColor(frame, frame_bw, CV_RGB2GRAY);
+        bgr_to_gray(frame, frame_bw);
         bool hasFace = detector->detect(frame_bw, bbox);
         if (showProcessedFrame)
         {
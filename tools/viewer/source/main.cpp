@@ -9,6 +9,7 @@
 #include <face-detector/detector.hpp>
 #include <ert/ObjectDetection.hh>
 #include <ert/SampleList.hh>
+#include <ert/AnnotationFile.hh>
 
 using namespace cv;
 using namespace ert;
@@ -36,6 +37,10 @@ const char *fittedFileName = NULL;
 
 const char *directory = NULL;
 
+const char *annotationFileName = NULL;
+
+AnnotationFile *annotations = NULL;
+
 bool showGoldParts = true;
 
 bool showFittedParts = true;
@@ -69,7 +74,8 @@ const uint16_t LAYOUT_68_PARTS[] =
 void main_usage()
 {
     std::cerr << "Usage: tool_viewer -i <image file> -f <fitted file> -p <points file>\n";
-    std::cerr << "Usage: tool_viewer -d <files path>\n";
+    std::cerr << "Usage: tool_viewer -i <image file> -f <fitted file> -a <annotation file>\n";
+    std::cerr << "Usage: tool_viewer -d <files path> [ -a <annotation file> ]\n";
     exit(EXIT_FAILURE);
 }
 
@@ -78,7 +84,7 @@ void main_parseOptions( int argc, char **argv )
 {
     int opt;
 
-    while ((opt = getopt(argc, argv, "i:p:f:d:v")) != -1)
+    while ((opt = getopt(argc, argv, "i:p:f:d:va:")) != -1)
     {
         switch (opt)
         {
@@ -97,11 +103,15 @@ void main_parseOptions( int argc, char **argv )
 			case 'v':
 				useViolaJones = true;
 				break;
+			case 'a':
+				annotationFileName = optarg;
+				break;
             default: /* '?' */
                 main_usage();
         }
     }
-    if (directory == NULL && (imageFileName == NULL || pointsFileName == NULL || fittedFileName == NULL))
+    if (directory == NULL && (imageFileName == NULL || fittedFileName == NULL ||
+        (pointsFileName == NULL && annotationFileName == NULL)))
     {
 		main_usage();
 	}
@@ -138,7 +148,14 @@ char main_display(
 	std::cout << "Displaying " << imageFile << std::endl;
 
 	Mat image = imread(imageFile);
-	ObjectDetection gold(pointsFile);
+	ObjectDetection gold;
+	if (annotations != NULL)
+	{
+		if (!annotations->find(imageFile, gold))
+			std::cout << "No annotations for " << imageFile << std::endl;
+	}
+	else
+		gold.load(pointsFile);
 	ObjectDetection fitted(fittedFile);
 	Rect area, face;
 
@@ -251,6 +268,18 @@ int main( int argc, char** argv )
 {
     main_parseOptions(argc, argv);
 
+	if (annotationFileName != NULL)
+	{
+		try
+		{
+			annotations = new AnnotationFile(annotationFileName);
+		} catch (std::exception &e)
+		{
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+
 	if (directory != NULL)
 	{
 		std::vector<string> *files = main_listDirectory(directory);
@@ -287,7 +316,9 @@ int main( int argc, char** argv )
 	}
 	else
 	{
-		main_display(imageFileName, pointsFileName, fittedFileName);
+		main_display(imageFileName, (pointsFileName != NULL) ? pointsFileName : "", fittedFileName);
 	}
 
+	delete annotations;
+
 }